@@ -0,0 +1,89 @@
+#! /usr/bin/env bash
+# Measures the overhead of the kaccessiblebridge plugin on an application. The
+# application is started with and without QT_ACCESSIBILITY=1, the focus is moved
+# around with the Tab key and the time till its first window is mapped and its
+# resident memory afterwards are printed. With QT_ACCESSIBILITY=1 the statistics of
+# the bridge (KACCESSIBLEBRIDGE_STATS) are collected too. The additional resident
+# memory and the average time per event are compared to the budget of the README,
+# the exit status is 2 if one of them is over budget.
+#
+# Usage: benchmark.sh [runs] [application [arguments]]
+# The default is 5 runs of "kwrite". The number of Tab key presses per run can be set
+# with the KEYS environment variable, the default is 500. xdotool is needed to wait
+# for the window and to send the keys.
+
+runs=${1:-5}
+shift
+[ $# -eq 0 ] && set -- kwrite
+keys=${KEYS:-500}
+
+# The budget, see the "Performance" section in the README.
+budget_rss_kb=512
+budget_event_usec=20
+
+if ! which xdotool >/dev/null 2>&1; then
+    echo "xdotool is needed to wait for the window of the application" >&2
+    exit 1
+fi
+
+log=$(mktemp)
+trap 'rm -f "$log"' EXIT
+
+# Prints the milliseconds till the first window of the application is mapped and its
+# resident memory in kB after the keys were sent. The stderr of the application is
+# appended to the log.
+measure() {
+    local start=$(date +%s%N)
+    "$@" >/dev/null 2>>"$log" &
+    local pid=$!
+    local window=$(xdotool search --sync --onlyvisible --pid $pid 2>/dev/null | head -n 1)
+    if [ -z "$window" ]; then
+        echo "$1 did not show a window" >&2
+        kill $pid 2>/dev/null
+        return 1
+    fi
+    local end=$(date +%s%N)
+    sleep 1
+    xdotool key --window $window --delay 10 --repeat $keys Tab >/dev/null 2>&1
+    sleep 1
+    local rss=$(awk '/^VmRSS:/ { print $2 }' /proc/$pid/status)
+    kill $pid 2>/dev/null
+    wait $pid 2>/dev/null
+    echo "$(( (end - start) / 1000000 )) $rss"
+}
+
+for accessibility in 0 1; do
+    total_ms=0
+    total_rss=0
+    for i in $(seq $runs); do
+        result=$(QT_ACCESSIBILITY=$accessibility KACCESSIBLEBRIDGE_STATS=$accessibility measure "$@") || exit 1
+        total_ms=$(( total_ms + ${result% *} ))
+        total_rss=$(( total_rss + ${result#* } ))
+    done
+    rss[$accessibility]=$(( total_rss / runs ))
+    echo "QT_ACCESSIBILITY=$accessibility: startup $(( total_ms / runs )) ms, resident memory ${rss[$accessibility]} kB (average of $runs runs)"
+done
+
+status=0
+
+rss_delta=$(( rss[1] - rss[0] ))
+if [ $rss_delta -gt $budget_rss_kb ]; then
+    echo "additional resident memory: $rss_delta kB (budget $budget_rss_kb kB) OVER BUDGET"
+    status=2
+else
+    echo "additional resident memory: $rss_delta kB (budget $budget_rss_kb kB)"
+fi
+
+# The bridge prints a line per 1000 events, e.g.
+# "kaccessiblebridge: 1000 events in 8123 us (average 8 us, max 153 us, budget 20 us), ..."
+events=$(sed -n 's/^kaccessiblebridge: \([0-9]*\) events in \([0-9]*\) us .*/\1 \2/p' "$log" | awk '{ events += $1; usec += $2 } END { if(events) print events, int(usec / events) }')
+if [ -z "$events" ]; then
+    echo "time per event: less than 1000 events, raise KEYS"
+elif [ ${events#* } -gt $budget_event_usec ]; then
+    echo "time per event: average ${events#* } us of ${events% *} events (budget $budget_event_usec us) OVER BUDGET"
+    status=2
+else
+    echo "time per event: average ${events#* } us of ${events% *} events (budget $budget_event_usec us)"
+fi
+
+exit $status
@@ -0,0 +1,15 @@
+# find the eSpeak NG speech synthesis library and header if available
+# This module defines
+#  ESPEAKNG_INCLUDE_DIR, where to find espeak-ng/speak_lib.h
+#  ESPEAKNG_LIBRARIES, the libraries needed to link against eSpeak NG
+#  ESPEAKNG_FOUND, If false, eSpeak NG was not found
+#
+# Redistribution and use is allowed according to the terms of the BSD license.
+# For details see the accompanying COPYING-CMAKE-SCRIPTS file.
+
+find_path(ESPEAKNG_INCLUDE_DIR espeak-ng/speak_lib.h)
+
+find_library(ESPEAKNG_LIBRARIES NAMES espeak-ng)
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(EspeakNG REQUIRED_VARS ESPEAKNG_INCLUDE_DIR ESPEAKNG_LIBRARIES)
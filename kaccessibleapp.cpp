@@ -25,23 +25,53 @@
 #include <QLayout>
 #include <QTimer>
 #include <QStack>
+#include <QQueue>
+#include <QPair>
 #include <QTextStream>
+#include <QTextBoundaryFinder>
+#include <QVector>
 #include <QLabel>
 #include <QCheckBox>
 #include <QTreeWidget>
 #include <QTreeWidgetItem>
 #include <QClipboard>
 #include <QMutex>
+#include <QAtomicInt>
 #include <QMutexLocker>
+#include <QWaitCondition>
+#include <QFutureWatcher>
+#include <QtConcurrentRun>
+#include <QFile>
+#include <QBuffer>
+#include <QtEndian>
+#include <qmath.h>
+#include <QPointer>
+#include <QSet>
+#include <QHash>
+#include <QContiguousCache>
+#include <QCache>
+#include <QLocale>
+#include <QDateTime>
+#include <QBasicTimer>
+#include <QElapsedTimer>
+#include <QTimerEvent>
 #include <QDBusConnection>
+#include <QDBusConnectionInterface>
 #include <QDBusInterface>
 #include <QDBusPendingCall>
+#include <QDBusPendingCallWatcher>
+#include <QDBusPendingReply>
+#include <QDBusReply>
+#include <QDBusServiceWatcher>
 #include <QDBusArgument>
+#include <QDBusMessage>
+#include <QDBusError>
 #include <QDBusMetaType>
 #include <kmainwindow.h>
 #include <kconfig.h>
 #include <kcombobox.h>
 #include <kconfiggroup.h>
+#include <ksharedconfig.h>
 #include <klocale.h>
 #include <kicon.h>
 #include <kaboutdata.h>
@@ -55,46 +85,563 @@
 #include <kpagewidget.h>
 #include <kpagewidgetmodel.h>
 
+#if defined(QTMULTIMEDIA_FOUND)
+#include <QAudioOutput>
+#include <QAudioFormat>
+#include <QAudioDeviceInfo>
+#endif
+
 #if defined(SPEECHD_FOUND)
 #include <libspeechd.h>
+#include <stdlib.h>
+#endif
+
+#if defined(ESPEAKNG_FOUND)
+#include <espeak-ng/speak_lib.h>
+#include <string.h>
 #endif
 
+Q_GLOBAL_STATIC(Settings, settings)
+
+class Settings::Private
+{
+    public:
+        KSharedConfig::Ptr m_config;
+        /// Only used by sync to write to disk without holding m_mutex.
+        KConfig *m_diskConfig;
+        mutable QMutex m_mutex;
+        QStringList m_changedKeys;
+        QTimer *m_syncTimer;
+        QThread *m_thread;
+        explicit Private() : m_diskConfig(0), m_syncTimer(0), m_thread(0) {}
+};
+
+Settings::Settings()
+    : d(new Private)
+{
+    d->m_config = KSharedConfig::openConfig(QLatin1String( "kaccessibleapp" ));
+    d->m_diskConfig = new KConfig(QLatin1String( "kaccessibleapp" ), KConfig::SimpleConfig);
+    d->m_syncTimer = new QTimer(this);
+    d->m_syncTimer->setSingleShot(true);
+    d->m_syncTimer->setInterval(2000);
+    connect(d->m_syncTimer, SIGNAL(timeout()), this, SLOT(sync()));
+
+    // The config is written to disk in a thread of its own so the thread processing
+    // the events never waits for the disk.
+    d->m_thread = new QThread;
+    d->m_thread->start(QThread::LowPriority);
+    moveToThread(d->m_thread);
+}
+
+Settings::~Settings()
+{
+    d->m_thread->quit();
+    d->m_thread->wait();
+    delete d->m_thread;
+    delete d->m_diskConfig;
+    delete d;
+}
+
+Settings* Settings::instance()
+{
+    return settings();
+}
+
+QVariant Settings::value(const char *key, const QVariant &defaultValue) const
+{
+    QMutexLocker locker(&d->m_mutex);
+    return d->m_config->group("Main").readEntry(key, defaultValue);
+}
+
+void Settings::setValue(const char *key, const QVariant &value)
+{
+    QMutexLocker locker(&d->m_mutex);
+    KConfigGroup group = d->m_config->group("Main");
+    group.writeEntry(key, value);
+    if(d->m_changedKeys.isEmpty())
+        QMetaObject::invokeMethod(this, "scheduleSync", Qt::QueuedConnection);
+    const QString name = QLatin1String( key );
+    if(!d->m_changedKeys.contains(name))
+        d->m_changedKeys.append(name);
+}
+
+KSharedConfig::Ptr Settings::config() const
+{
+    return d->m_config;
+}
+
+QMutex* Settings::mutex() const
+{
+    return &d->m_mutex;
+}
+
+void Settings::sync()
+{
+    d->m_syncTimer->stop();
+    {
+        // Only the Main and the State group are written by us. They are copied in
+        // memory so the lock isn't held while the disk is written.
+        QMutexLocker locker(&d->m_mutex);
+        if(!d->m_config->isDirty())
+            return;
+        foreach(const char *name, QList<const char*>() << "Main" << "State") {
+            KConfigGroup group = d->m_diskConfig->group(name);
+            group.deleteGroup();
+            d->m_config->group(name).copyTo(&group);
+        }
+        d->m_config->markAsClean();
+    }
+    d->m_diskConfig->sync();
+}
+
+void Settings::scheduleSync()
+{
+    QStringList keys;
+    {
+        QMutexLocker locker(&d->m_mutex);
+        keys = d->m_changedKeys;
+        d->m_changedKeys.clear();
+    }
+    if(!d->m_syncTimer->isActive())
+        d->m_syncTimer->start();
+    emit changed(keys);
+}
+
 Q_GLOBAL_STATIC(Speaker, speaker)
 
+/// The output modules and voices of speech-dispatcher, see Speaker::voices.
+class VoiceCatalogue
+{
+    public:
+        QStringList m_modules;
+        KAccessibleVoiceList m_voices;
+        QStringList m_languages;
+        QHash<QString, QList<int> > m_byLanguage;
+
+        void buildIndex()
+        {
+            m_languages.clear();
+            m_byLanguage.clear();
+            for(int i = 0; i < m_voices.count(); ++i) {
+                const QString &language = m_voices[i].language;
+                if(language.isEmpty())
+                    continue;
+                QHash<QString, QList<int> >::Iterator it = m_byLanguage.find(language);
+                if(it == m_byLanguage.end()) {
+                    m_languages.append(language);
+                    it = m_byLanguage.insert(language, QList<int>());
+                }
+                it.value().append(i);
+            }
+        }
+
+#if defined(SPEECHD_FOUND)
+        /// Fetches the catalogue. This is called in a thread of the global QThreadPool.
+        static VoiceCatalogue fetch(SPDConnection *connection)
+        {
+            VoiceCatalogue catalogue;
+            if(char** modules = spd_list_modules(connection)) {
+                for(int i = 0; modules[i]; ++i) {
+                    catalogue.m_modules.append(QString::fromLatin1(modules[i]));
+                    free(modules[i]);
+                }
+                free(modules);
+            }
+            if(SPDVoice** voices = spd_list_synthesis_voices(connection)) {
+                for(int i = 0; voices[i]; ++i) {
+                    KAccessibleVoice voice;
+                    voice.name = QString::fromUtf8(voices[i]->name);
+                    voice.language = QString::fromLatin1(voices[i]->language);
+                    voice.variant = QString::fromLatin1(voices[i]->variant);
+                    catalogue.m_voices.append(voice);
+                    free(voices[i]->name);
+                    free(voices[i]->language);
+                    free(voices[i]->variant);
+                    free(voices[i]);
+                }
+                free(voices);
+            }
+            catalogue.buildIndex();
+            return catalogue;
+        }
+#endif
+};
+
+/// The sample rate of the PCM of the earcons and the cached phrases, 16 bit signed mono.
+static const int s_audioSampleRate = 22050;
+
+/// The buffer of the audio output in milliseconds. The shorter the sooner a sound is heard.
+static const int s_audioBufferMsecs = 20;
+
+/**
+ * Plays PCM of the format above. Other than the speech the audio is not queued, a
+ * new sound replaces the one playing, and it is mixed with the speech by the sound
+ * system.
+ */
+class AudioSink
+{
+    public:
+        virtual ~AudioSink() {}
+        virtual void play(const QByteArray &pcm) = 0;
+        virtual void stop() = 0;
+
+        /**
+         * Returns a new sink of the \p kind , "null", "file:<path>" or the default. The
+         * null sink is used if no audio output is available.
+         */
+        static AudioSink* create(const QString &kind);
+};
+
+/// Plays nothing but counts what would have been played, for running headless.
+class NullAudioSink : public AudioSink
+{
+    public:
+        explicit NullAudioSink() : m_played(0), m_bytes(0) {}
+        virtual void play(const QByteArray &pcm) { ++m_played; m_bytes += pcm.size(); }
+        virtual void stop() {}
+        int m_played;
+        qint64 m_bytes;
+};
+
+#if defined(QTMULTIMEDIA_FOUND)
+/// Plays through a QAudioOutput with a small buffer.
+class QtAudioSink : public AudioSink
+{
+    public:
+        explicit QtAudioSink()
+        {
+            QAudioFormat format;
+            format.setFrequency(s_audioSampleRate);
+            format.setChannels(1);
+            format.setSampleSize(16);
+            format.setCodec(QLatin1String( "audio/pcm" ));
+            format.setByteOrder(QAudioFormat::LittleEndian);
+            format.setSampleType(QAudioFormat::SignedInt);
+            if(!QAudioDeviceInfo::defaultOutputDevice().isFormatSupported(format))
+                kWarning() << "The audio output does not support the format of the earcons";
+            m_output = new QAudioOutput(format);
+            m_output->setBufferSize(s_audioSampleRate * 2 * s_audioBufferMsecs / 1000);
+        }
+        virtual ~QtAudioSink()
+        {
+            delete m_output;
+        }
+        virtual void play(const QByteArray &pcm)
+        {
+            stop();
+            m_buffer.setData(pcm);
+            m_buffer.open(QIODevice::ReadOnly);
+            m_output->start(&m_buffer);
+        }
+        virtual void stop()
+        {
+            m_output->stop();
+            m_buffer.close();
+        }
+    private:
+        QAudioOutput *m_output;
+        QBuffer m_buffer;
+};
+#endif
+
+/// Appends what is played to a file of raw PCM, for checking the output without a sound card.
+class FileAudioSink : public AudioSink
+{
+    public:
+        explicit FileAudioSink(const QString &fileName) : m_file(fileName)
+        {
+            if(!m_file.open(QIODevice::WriteOnly | QIODevice::Append))
+                kWarning() << "Failed to open the audio file" << fileName;
+        }
+        virtual void play(const QByteArray &pcm) { if(m_file.isOpen()) { m_file.write(pcm); m_file.flush(); } }
+        virtual void stop() {}
+    private:
+        QFile m_file;
+};
+
+AudioSink* AudioSink::create(const QString &kind)
+{
+    if(kind.startsWith(QLatin1String( "file:" )))
+        return new FileAudioSink(kind.mid(5));
+#if defined(QTMULTIMEDIA_FOUND)
+    if(kind != QLatin1String( "null" ))
+        return new QtAudioSink;
+#endif
+    return new NullAudioSink;
+}
+
+/**
+ * Returns the 16 bit little endian \p pcm with \p channels interleaved at the \p rate
+ * as mono at s_audioSampleRate , at most \p maxSamples long. The samples are mixed
+ * down and resampled once so playing is copying only.
+ */
+static QByteArray convertPcm(const QByteArray &pcm, int channels, int rate, int maxSamples)
+{
+    const qint16 *in = reinterpret_cast<const qint16*>(pcm.constData());
+    const int frames = pcm.size() / 2 / channels;
+    if(frames < 1)
+        return QByteArray();
+    const int count = qMin(int(qint64(frames) * s_audioSampleRate / rate), maxSamples);
+    QByteArray result(count * 2, 0);
+    qint16 *out = reinterpret_cast<qint16*>(result.data());
+    for(int i = 0; i < count; ++i) {
+        const int frame = qMin(int(qint64(i) * rate / s_audioSampleRate), frames - 1);
+        int sum = 0;
+        for(int c = 0; c < channels; ++c)
+            sum += qFromLittleEndian(in[frame * channels + c]);
+        out[i] = qToLittleEndian(qint16(sum / channels));
+    }
+    return result;
+}
+
+/// Texts longer than that many bytes of UTF-8 are never cached as phrase.
+static const int s_maxPhraseLength = 100;
+
+/// The number of phrases waiting to be synthesized in advance, older ones are dropped.
+static const int s_maxPendingPhrases = 128;
+
+/**
+ * Synthesizes short phrases in-process with eSpeak NG, see Speaker::setPhraseCache .
+ * The engine is not reentrant, the calls are serialized.
+ */
+class PhraseSynthesizer
+{
+    public:
+        explicit PhraseSynthesizer() : m_sampleRate(0)
+        {
+#if defined(ESPEAKNG_FOUND)
+            m_sampleRate = espeak_Initialize(AUDIO_OUTPUT_SYNCHRONOUS, 0, NULL, 0);
+            if(m_sampleRate > 0)
+                espeak_SetSynthCallback(synthCallback);
+            else
+                kWarning() << "Failed to initialize eSpeak NG";
+#endif
+        }
+        ~PhraseSynthesizer()
+        {
+#if defined(ESPEAKNG_FOUND)
+            if(m_sampleRate > 0)
+                espeak_Terminate();
+#endif
+        }
+
+        bool isAvailable() const { return m_sampleRate > 0; }
+
+        /**
+         * Returns the PCM of the \p utf8 text spoken with the speech-dispatcher
+         * \p voiceType at the \p rate from -100 to 100 in the \p language , e.g. "de",
+         * or an empty array on failure. This is called in a thread of the global
+         * QThreadPool.
+         */
+        QByteArray synthesize(const QByteArray &utf8, int voiceType, int rate, const QByteArray &language)
+        {
+            QByteArray pcm;
+#if defined(ESPEAKNG_FOUND)
+            if(m_sampleRate <= 0)
+                return pcm;
+            QMutexLocker locker(&m_mutex);
+            // The same mapping as the espeak module of speech-dispatcher uses.
+            const int normalRate = 170;
+            espeak_SetParameter(espeakRATE, rate < 0 ? normalRate + (normalRate - 80) * rate / 100 : normalRate + (390 - normalRate) * rate / 100, 0);
+            espeak_VOICE voice;
+            memset(&voice, 0, sizeof(voice));
+            voice.languages = language.constData();
+            voice.gender = (voiceType >= 4 && voiceType <= 6) || voiceType == 8 ? 2 : 1;
+            voice.age = voiceType >= 7 ? 10 : 0;
+            voice.variant = voiceType >= 1 && voiceType <= 6 ? (voiceType - 1) % 3 : 0;
+            espeak_SetVoiceByProperties(&voice);
+            if(espeak_Synth(utf8.constData(), utf8.size() + 1, 0, POS_CHARACTER, 0, espeakCHARS_UTF8, NULL, &pcm) != EE_OK) {
+                kWarning() << "Failed to synthesize text=" << utf8;
+                return QByteArray();
+            }
+            if(m_sampleRate != s_audioSampleRate)
+                pcm = convertPcm(pcm, 1, m_sampleRate, pcm.size() * 2);
+#else
+            Q_UNUSED(utf8);
+            Q_UNUSED(voiceType);
+            Q_UNUSED(rate);
+            Q_UNUSED(language);
+#endif
+            return pcm;
+        }
+
+    private:
+#if defined(ESPEAKNG_FOUND)
+        static int synthCallback(short *wav, int samples, espeak_EVENT *events)
+        {
+            QByteArray *pcm = static_cast<QByteArray*>(events->user_data);
+            for(int i = 0; wav && i < samples; ++i) {
+                const qint16 sample = qToLittleEndian(qint16(wav[i]));
+                pcm->append(reinterpret_cast<const char*>(&sample), 2);
+            }
+            return 0;
+        }
+#endif
+        int m_sampleRate;
+        QMutex m_mutex;
+};
+
+Q_GLOBAL_STATIC(PhraseSynthesizer, phraseSynthesizer)
+
+/// The time from a key press to the start of its echo that should not be exceeded, in milliseconds.
+static const int s_keyEchoTargetMsecs = 50;
+
+/// An echo that arrives later than that after the key press is not spoken anymore, in milliseconds.
+static const int s_maxKeyEchoAge = 500;
+
+/// A text waiting in the say stack of the Speaker.
+class Utterance
+{
+    public:
+        QByteArray m_utf8;
+        Speaker::Priority m_priority;
+        int m_id;
+        explicit Utterance() : m_priority(Speaker::Text), m_id(0) {}
+        Utterance(const QByteArray &utf8, Speaker::Priority priority, int id) : m_utf8(utf8), m_priority(priority), m_id(id) {}
+};
+
 class Speaker::Private
 {
     public:
         bool m_isSpeaking;
         int m_voiceType;
-        QStack< QPair<QString,Speaker::Priority> > m_sayStack;
+        QString m_voice;
+        QStack<Utterance> m_sayStack;
+        int m_lastId;
+        QHash<int, int> m_sent; // speech-dispatcher message id => utterance id
+        QSet<int> m_discarded; // speech-dispatcher message ids to stop once they start
+        int m_rate;
+        int m_averageDuration;
+        QElapsedTimer m_utteranceTimer;
+        int m_echoMessage; // the speech-dispatcher message id of the last echo
+        QSet<int> m_echoMessages; // the echoes not spoken to the end yet
+        qlonglong m_echoTimestamp;
+        int m_echoLatency;
+        int m_maxEchoLatency;
+        int m_speakingMessage; // the speech-dispatcher message id spoken right now
+        // Guards the two above that are set from the thread of speech-dispatcher. Unlike
+        // m_mutex it's never held while calling speech-dispatcher, which needs that
+        // thread to answer.
+        mutable QMutex m_speakingMutex;
         QMutex m_mutex;
+        VoiceCatalogue m_catalogue;
+        mutable QMutex m_catalogueMutex;
+        QFutureWatcher<VoiceCatalogue> m_catalogueWatcher;
+        AudioSink *m_phraseSink; // null while the phrase cache is disabled
+        QCache<QByteArray, QByteArray> m_phrases; // phraseKey => PCM
+        QList<QByteArray> m_pendingPhrases; // keys to synthesize in advance
+        QMutex m_phraseMutex; // guards the two above
+        QFuture<void> m_phraseFuture;
+        QTimer m_phraseTimer; // runs while a cached phrase is played
+        int m_phraseId; // the utterance id of that phrase
+        QByteArray m_language; // the language of speech-dispatcher and the phrases
+        bool m_phraseModule; // speech-dispatcher speaks with eSpeak NG too, see reconnect
+        bool m_anyPhraseModule; // cache phrases whatever module speech-dispatcher uses
+        QAtomicInt m_phraseHits; // counted in sayNext, read by phraseCacheStatistics
+        QAtomicInt m_phraseMisses;
 #if defined(SPEECHD_FOUND)
         SPDConnection *m_connection;
+        SPDConnection *m_echoConnection; // the echo lane, see Speaker::echo
 #endif
         explicit Private()
             : m_isSpeaking(false)
             , m_voiceType(1)
+            , m_lastId(0)
+            , m_rate(0)
+            , m_averageDuration(0)
+            , m_echoMessage(0)
+            , m_echoTimestamp(0)
+            , m_echoLatency(0)
+            , m_maxEchoLatency(0)
+            , m_speakingMessage(0)
+            , m_phraseSink(0)
+            , m_phraseId(0)
+            , m_phraseModule(false)
+            , m_anyPhraseModule(false)
+            , m_phraseHits(0)
+            , m_phraseMisses(0)
 #if defined(SPEECHD_FOUND)
             , m_connection(0)
+            , m_echoConnection(0)
 #endif
         {
+            m_phraseTimer.setSingleShot(true);
+        }
+
+        /// The key of the cached phrase, the text and all that changes how it sounds.
+        static QByteArray phraseKey(const QByteArray &utf8, int voiceType, int rate, const QByteArray &language)
+        {
+            QByteArray key = utf8;
+            key += '\0';
+            key += QByteArray::number(voiceType);
+            key += ' ';
+            key += QByteArray::number(rate);
+            key += ' ';
+            key += language;
+            return key;
+        }
+
+        /**
+         * Synthesizes the pending phrases till there are none left. This is called in a
+         * thread of the global QThreadPool.
+         */
+        void synthesizePhrases()
+        {
+            forever {
+                QByteArray key;
+                {
+                    QMutexLocker locker(&m_phraseMutex);
+                    if(m_pendingPhrases.isEmpty())
+                        return;
+                    key = m_pendingPhrases.takeFirst();
+                    if(m_phrases.contains(key))
+                        continue;
+                }
+                const QList<QByteArray> parts = key.split('\0');
+                const QList<QByteArray> voice = parts.last().split(' ');
+                PhraseSynthesizer *synthesizer = phraseSynthesizer();
+                if(!synthesizer) // already destroyed on exit
+                    return;
+                const QByteArray pcm = synthesizer->synthesize(parts.first(), voice.value(0).toInt(), voice.value(1).toInt(), voice.value(2));
+                if(pcm.isEmpty())
+                    continue;
+                QMutexLocker locker(&m_phraseMutex);
+                m_phrases.insert(key, new QByteArray(pcm), pcm.size());
+            }
+        }
+
+        /// Queues the phrases with the \p keys for synthesis. The caller holds m_phraseMutex.
+        void preparePhrases(const QList<QByteArray> &keys)
+        {
+            foreach(const QByteArray &key, keys)
+                if(!m_phrases.contains(key) && !m_pendingPhrases.contains(key))
+                    m_pendingPhrases.append(key);
+            while(m_pendingPhrases.count() > s_maxPendingPhrases)
+                m_pendingPhrases.removeFirst();
+            if(!m_pendingPhrases.isEmpty() && !m_phraseFuture.isRunning())
+                m_phraseFuture = QtConcurrent::run(this, &Private::synthesizePhrases);
         }
 #if defined(SPEECHD_FOUND)
         static void speechdCallback(size_t msg_id, size_t client_id, SPDNotificationType state)
         {
-            Q_UNUSED(msg_id);
             Q_UNUSED(client_id);
             switch(state) {
-                case SPD_EVENT_BEGIN:
-                    Speaker::instance()->setSpeaking(true);
-                    break;
+                case SPD_EVENT_BEGIN: {
+                    Private *d = Speaker::instance()->d;
+                    {
+                        QMutexLocker locker(&d->m_speakingMutex);
+                        d->m_isSpeaking = true;
+                        d->m_speakingMessage = int(msg_id);
+                    }
+                    QMetaObject::invokeMethod(Speaker::instance(), "utteranceStarted", Qt::QueuedConnection, Q_ARG(int, int(msg_id)), Q_ARG(qlonglong, QDateTime::currentMSecsSinceEpoch()));
+                } break;
                 case SPD_EVENT_END:
                     Speaker::instance()->setSpeaking(false);
-                    QTimer::singleShot(0, Speaker::instance(), SLOT(sayNext()));
+                    QMetaObject::invokeMethod(Speaker::instance(), "utteranceEnded", Qt::QueuedConnection, Q_ARG(int, int(msg_id)), Q_ARG(bool, false));
                     break;
                 case SPD_EVENT_CANCEL:
                     Speaker::instance()->setSpeaking(false);
-                    Speaker::instance()->clearSayStack();
+                    QMetaObject::invokeMethod(Speaker::instance(), "utteranceEnded", Qt::QueuedConnection, Q_ARG(int, int(msg_id)), Q_ARG(bool, true));
                     break;
                 case SPD_EVENT_PAUSE:
                     break;
@@ -104,17 +651,29 @@ class Speaker::Private
                     break;
             }
         }
+
+        static void echoCallback(size_t msg_id, size_t client_id, SPDNotificationType state)
+        {
+            Q_UNUSED(client_id);
+            if(state == SPD_EVENT_BEGIN)
+                QMetaObject::invokeMethod(Speaker::instance(), "echoStarted", Qt::QueuedConnection, Q_ARG(int, int(msg_id)), Q_ARG(qlonglong, QDateTime::currentMSecsSinceEpoch()));
+            else if(state == SPD_EVENT_END || state == SPD_EVENT_CANCEL)
+                QMetaObject::invokeMethod(Speaker::instance(), "echoEnded", Qt::QueuedConnection, Q_ARG(int, int(msg_id)));
+        }
 #endif
 };
 
 Speaker::Speaker()
     : d(new Private)
 {
+    connect(&d->m_catalogueWatcher, SIGNAL(finished()), this, SLOT(catalogueFetched()));
+    connect(&d->m_phraseTimer, SIGNAL(timeout()), this, SLOT(phraseFinished()));
 }
 
 Speaker::~Speaker()
 {
     disconnect();
+    setPhraseCache(0, QString(), false);
     delete d;
 }
 
@@ -136,6 +695,8 @@ void Speaker::disconnect()
 {
 #if defined(SPEECHD_FOUND)
     if(d->m_connection) {
+        // the catalogue may still be fetched using the connection
+        d->m_catalogueWatcher.waitForFinished();
         spd_set_notification_off(d->m_connection, SPD_BEGIN);
         spd_set_notification_off(d->m_connection, SPD_END);
         spd_set_notification_off(d->m_connection, SPD_CANCEL);
@@ -145,9 +706,26 @@ void Speaker::disconnect()
         spd_cancel_all(d->m_connection);
         spd_close(d->m_connection);
         d->m_connection = 0;
-        d->m_isSpeaking = false;
+        {
+            QMutexLocker speakingLocker(&d->m_speakingMutex);
+            d->m_isSpeaking = false;
+            d->m_speakingMessage = 0;
+        }
         d->m_sayStack.clear();
+        d->m_sent.clear();
+        d->m_discarded.clear();
     }
+    if(d->m_echoConnection) {
+        spd_set_notification_off(d->m_echoConnection, SPD_BEGIN);
+        spd_set_notification_off(d->m_echoConnection, SPD_END);
+        spd_set_notification_off(d->m_echoConnection, SPD_CANCEL);
+        d->m_echoConnection->callback_begin = d->m_echoConnection->callback_end = d->m_echoConnection->callback_cancel = 0;
+        spd_cancel(d->m_echoConnection);
+        spd_close(d->m_echoConnection);
+        d->m_echoConnection = 0;
+    }
+    d->m_echoMessage = 0;
+    d->m_echoMessages.clear();
 #endif
 }
 
@@ -162,187 +740,3218 @@ bool Speaker::reconnect()
         return false;
     }
 
-    d->m_connection->callback_begin = d->m_connection->callback_end = d->m_connection->callback_cancel = d->m_connection->callback_pause = d->m_connection->callback_resume = Private::speechdCallback;
-    spd_set_notification_on(d->m_connection, SPD_BEGIN);
-    spd_set_notification_on(d->m_connection, SPD_END);
-    spd_set_notification_on(d->m_connection, SPD_CANCEL);
-    spd_set_notification_on(d->m_connection, SPD_PAUSE);
-    spd_set_notification_on(d->m_connection, SPD_RESUME);
-#endif
+    d->m_connection->callback_begin = d->m_connection->callback_end = d->m_connection->callback_cancel = d->m_connection->callback_pause = d->m_connection->callback_resume = Private::speechdCallback;
+    spd_set_notification_on(d->m_connection, SPD_BEGIN);
+    spd_set_notification_on(d->m_connection, SPD_END);
+    spd_set_notification_on(d->m_connection, SPD_CANCEL);
+    spd_set_notification_on(d->m_connection, SPD_PAUSE);
+    spd_set_notification_on(d->m_connection, SPD_RESUME);
+
+    // The echoes have a connection of their own so stale ones can be cancelled without
+    // touching the other messages. Without it they are said on the main connection.
+    d->m_echoConnection = spd_open("kaccessible", "echo", NULL, SPD_MODE_THREADED);
+    if(d->m_echoConnection) {
+        d->m_echoConnection->callback_begin = d->m_echoConnection->callback_end = d->m_echoConnection->callback_cancel = Private::echoCallback;
+        spd_set_notification_on(d->m_echoConnection, SPD_BEGIN);
+        spd_set_notification_on(d->m_echoConnection, SPD_END);
+        spd_set_notification_on(d->m_echoConnection, SPD_CANCEL);
+    } else {
+        kWarning() << "Failed to open the echo connection with speech-dispatcher";
+    }
+
+    // The catalogue is fetched once per connection without blocking the caller.
+    d->m_catalogueWatcher.setFuture(QtConcurrent::run(VoiceCatalogue::fetch, d->m_connection));
+
+    // Phrases are only cached by default if they sound the same as from speech-dispatcher.
+    d->m_phraseModule = false;
+    if(char *module = spd_get_output_module(d->m_connection)) {
+        d->m_phraseModule = QByteArray(module).startsWith("espeak");
+        free(module);
+    }
+#else
+    d->m_phraseModule = true;
+#endif
+
+    if(!d->m_language.isEmpty())
+        setLanguage(QString::fromLatin1(d->m_language));
+
+    setVoiceType(d->m_voiceType);
+    if(!d->m_voice.isEmpty())
+        setVoice(d->m_voice);
+    if(d->m_rate)
+        setRate(d->m_rate);
+    return true;
+}
+
+bool Speaker::isSpeaking() const
+{
+    QMutexLocker locker(&d->m_speakingMutex);
+    return d->m_isSpeaking;
+}
+
+void Speaker::setSpeaking(bool speaking)
+{
+    QMutexLocker locker(&d->m_speakingMutex);
+    d->m_isSpeaking = speaking;
+}
+
+void Speaker::cancel()
+{
+    QMutexLocker locker(&d->m_mutex);
+    // Queued utterances never reach speech-dispatcher, tell about them here.
+    foreach(const Utterance &u, d->m_sayStack)
+        QMetaObject::invokeMethod(this, "cancelled", Qt::QueuedConnection, Q_ARG(int, u.m_id));
+    d->m_sayStack.clear();
+    stopPhrase();
+#if defined(SPEECHD_FOUND)
+    if(d->m_connection) {
+        spd_cancel_all(d->m_connection);
+    }
+#endif
+}
+
+bool Speaker::say(const QString& text, Priority priority)
+{
+    return sayUtf8(text.toUtf8(), priority);
+}
+
+bool Speaker::sayUtf8(const QByteArray& utf8, Priority priority)
+{
+    QMutexLocker locker(&d->m_mutex);
+    if(!isConnected())
+        return false;
+    interruptPhrase(priority);
+    d->m_sayStack.push( Utterance(utf8, priority, ++d->m_lastId) );
+    if(!isSpeaking())
+        QMetaObject::invokeMethod(this, "sayNext", Qt::QueuedConnection);
+    return true;
+}
+
+int Speaker::append(const QByteArray& utf8, Priority priority)
+{
+    QMutexLocker locker(&d->m_mutex);
+    if(!isConnected())
+        return 0;
+    const int id = ++d->m_lastId;
+    interruptPhrase(priority);
+    d->m_sayStack.prepend( Utterance(utf8, priority, id) );
+    if(!isSpeaking())
+        QMetaObject::invokeMethod(this, "sayNext", Qt::QueuedConnection);
+    return id;
+}
+
+bool Speaker::echo(const QByteArray& utf8, qlonglong timestamp)
+{
+    QMutexLocker locker(&d->m_mutex);
+    if(!isConnected())
+        return false;
+    stopPhrase();
+#if defined(SPEECHD_FOUND)
+    if(SPDConnection *connection = d->m_echoConnection ? d->m_echoConnection : d->m_connection) {
+        // Messages interrupt texts but queue behind each other, so the stale echoes,
+        // spoken or still queued, are cancelled here. Only the echo lane is cancelled.
+        if(d->m_echoConnection && !d->m_echoMessages.isEmpty()) {
+            spd_cancel(d->m_echoConnection);
+            d->m_echoMessages.clear();
+        }
+        const int msg_id = spd_say(connection, SPD_MESSAGE, utf8.constData());
+        if(msg_id == -1) {
+            kWarning() << "Failed to echo text=" << utf8;
+            d->m_echoMessage = 0;
+            return false;
+        }
+        d->m_echoMessage = msg_id;
+        d->m_echoMessages.insert(msg_id);
+        d->m_echoTimestamp = timestamp;
+    }
+#else
+    Q_UNUSED(utf8);
+    Q_UNUSED(timestamp);
+#endif
+    return true;
+}
+
+int Speaker::echoLatency() const
+{
+    return d->m_echoLatency;
+}
+
+int Speaker::maxEchoLatency() const
+{
+    return d->m_maxEchoLatency;
+}
+
+void Speaker::remove(const QList<int>& ids)
+{
+    QMutexLocker locker(&d->m_mutex);
+    for(int i = d->m_sayStack.count() - 1; i >= 0; --i)
+        if(ids.contains(d->m_sayStack[i].m_id))
+            d->m_sayStack.remove(i);
+    if(ids.contains(d->m_phraseId))
+        stopPhrase();
+#if defined(SPEECHD_FOUND)
+    // spd_stop only stops the message spoken right now, spd_cancel would discard all
+    // other messages queued in speech-dispatcher too. Removed messages that are still
+    // queued there are stopped once they start, see utteranceStarted.
+    int speakingMessage = 0;
+    {
+        QMutexLocker speakingLocker(&d->m_speakingMutex);
+        if(d->m_isSpeaking)
+            speakingMessage = d->m_speakingMessage;
+    }
+    for(QHash<int, int>::ConstIterator it = d->m_sent.constBegin(); it != d->m_sent.constEnd(); ++it) {
+        if(!ids.contains(it.value()))
+            continue;
+        if(speakingMessage && it.key() == speakingMessage) {
+            if(d->m_connection)
+                spd_stop(d->m_connection);
+        } else {
+            d->m_discarded.insert(it.key());
+        }
+    }
+#endif
+}
+
+void Speaker::sayNext()
+{
+    QMutexLocker locker(&d->m_mutex);
+    if(d->m_sayStack.isEmpty()) {
+        return;
+    }
+    Utterance p = d->m_sayStack.pop();
+
+    // Short phrases that were synthesized before play right away. The others are spoken
+    // by speech-dispatcher and synthesized for the next time. Only plain texts are
+    // played here, the other priorities need the rules of speech-dispatcher, and only
+    // if nothing sent to speech-dispatcher is still waiting for its start or end.
+    if(hasPhraseCache() && d->m_voice.isEmpty() && p.m_priority == Text && d->m_sent.isEmpty() && !isSpeaking() && p.m_utf8.size() <= s_maxPhraseLength) {
+        const QByteArray key = Private::phraseKey(p.m_utf8, d->m_voiceType, d->m_rate, d->m_language);
+        QByteArray pcm;
+        {
+            QMutexLocker phraseLocker(&d->m_phraseMutex);
+            if(QByteArray *cached = d->m_phrases.object(key))
+                pcm = *cached;
+            else
+                d->preparePhrases(QList<QByteArray>() << key);
+        }
+        if(!pcm.isEmpty()) {
+            d->m_phraseHits.ref();
+            d->m_phraseId = p.m_id;
+            setSpeaking(true);
+            d->m_phraseSink->play(pcm);
+            d->m_phraseTimer.start(qint64(pcm.size()) / 2 * 1000 / s_audioSampleRate);
+            d->m_utteranceTimer.start();
+            return;
+        }
+        d->m_phraseMisses.ref();
+    }
+
+#if defined(SPEECHD_FOUND)
+    if(d->m_connection) {
+        SPDPriority spdpriority = (SPDPriority) p.m_priority;
+        int msg_id  = spd_say(d->m_connection, spdpriority, p.m_utf8.constData());
+        if(msg_id == -1) {
+            kWarning() << "Failed to say text=" << p.m_utf8;
+            QMetaObject::invokeMethod(this, "cancelled", Qt::QueuedConnection, Q_ARG(int, p.m_id));
+        } else {
+            d->m_sent.insert(msg_id, p.m_id);
+        }
+    }
+#else
+    //QDBusInterface iface("org.kde.jovie","/KSpeech");
+    //iface.asyncCall("say", text, 0);
+#endif
+}
+
+void Speaker::utteranceStarted(int messageId, qlonglong time)
+{
+#if defined(SPEECHD_FOUND)
+    {
+        QMutexLocker locker(&d->m_mutex);
+        if(d->m_discarded.remove(messageId)) {
+            // The notification is queued, another message may be spoken by now.
+            bool stop;
+            {
+                QMutexLocker speakingLocker(&d->m_speakingMutex);
+                stop = d->m_isSpeaking && d->m_speakingMessage == messageId;
+            }
+            if(stop && d->m_connection)
+                spd_stop(d->m_connection);
+            return;
+        }
+    }
+#endif
+    d->m_utteranceTimer.start();
+    // Without an echo lane the echoes are said on the main connection.
+    if(messageId == d->m_echoMessage)
+        echoStarted(messageId, time);
+}
+
+void Speaker::echoStarted(int messageId, qlonglong time)
+{
+    if(messageId != d->m_echoMessage)
+        return;
+    const int latency = int(qMax(qlonglong(0), time - d->m_echoTimestamp));
+    d->m_echoLatency = d->m_echoLatency ? (7 * d->m_echoLatency + latency) / 8 : latency;
+    d->m_maxEchoLatency = qMax(d->m_maxEchoLatency, latency);
+    if(latency > s_keyEchoTargetMsecs)
+        kDebug() << "Key echo took" << latency << "ms, the target is" << s_keyEchoTargetMsecs << "ms";
+}
+
+void Speaker::utteranceEnded(int messageId, bool cancelled)
+{
+    int id;
+    {
+        QMutexLocker locker(&d->m_mutex);
+        id = d->m_sent.take(messageId);
+        d->m_discarded.remove(messageId);
+    }
+    // The short echoes would make the utterances look faster than they are.
+    const bool isEcho = messageId == d->m_echoMessage;
+    if(isEcho)
+        echoEnded(messageId);
+    if(!cancelled && !isEcho && d->m_utteranceTimer.isValid()) {
+        const int duration = d->m_utteranceTimer.elapsed();
+        d->m_averageDuration = d->m_averageDuration ? (7 * d->m_averageDuration + duration) / 8 : duration;
+    }
+    d->m_utteranceTimer.invalidate();
+    if(id) {
+        if(cancelled)
+            emit this->cancelled(id);
+        else
+            emit finished(id);
+    }
+    sayNext();
+}
+
+void Speaker::echoEnded(int messageId)
+{
+    QMutexLocker locker(&d->m_mutex);
+    d->m_echoMessages.remove(messageId);
+    if(messageId == d->m_echoMessage)
+        d->m_echoMessage = 0;
+}
+
+void Speaker::stopPhrase()
+{
+    if(!d->m_phraseId)
+        return;
+    d->m_phraseSink->stop();
+    d->m_phraseTimer.stop();
+    d->m_utteranceTimer.invalidate();
+    setSpeaking(false);
+    QMetaObject::invokeMethod(this, "cancelled", Qt::QueuedConnection, Q_ARG(int, d->m_phraseId));
+    d->m_phraseId = 0;
+    QMetaObject::invokeMethod(this, "sayNext", Qt::QueuedConnection);
+}
+
+void Speaker::interruptPhrase(Priority priority)
+{
+    // Like speech-dispatcher does with texts, important texts and messages interrupt a
+    // cached phrase.
+    if(d->m_phraseId && (priority == Important || priority == Message))
+        stopPhrase();
+}
+
+void Speaker::phraseFinished()
+{
+    const int id = d->m_phraseId;
+    if(!id)
+        return;
+    d->m_phraseId = 0;
+    setSpeaking(false);
+    const int duration = d->m_utteranceTimer.elapsed();
+    d->m_averageDuration = d->m_averageDuration ? (7 * d->m_averageDuration + duration) / 8 : duration;
+    d->m_utteranceTimer.invalidate();
+    emit finished(id);
+    sayNext();
+}
+
+void Speaker::setPhraseCache(int maxKb, const QString &sink, bool anyModule)
+{
+    d->m_anyPhraseModule = anyModule;
+    {
+        QMutexLocker locker(&d->m_mutex);
+        if(d->m_phraseSink) {
+            stopPhrase();
+            delete d->m_phraseSink;
+            d->m_phraseSink = 0;
+        }
+    }
+    {
+        QMutexLocker locker(&d->m_phraseMutex);
+        d->m_pendingPhrases.clear();
+    }
+    d->m_phraseFuture.waitForFinished();
+    QMutexLocker locker(&d->m_phraseMutex);
+    if(maxKb <= 0 || !phraseSynthesizer()->isAvailable()) {
+        d->m_phrases.clear();
+        return;
+    }
+    d->m_phrases.setMaxCost(maxKb * 1024);
+    d->m_phraseSink = AudioSink::create(sink);
+}
+
+bool Speaker::hasPhraseCache() const
+{
+    // Else the same phrase would sound different when it is cached.
+    return d->m_phraseSink && (d->m_phraseModule || d->m_anyPhraseModule);
+}
+
+void Speaker::preparePhrases(const QList<QByteArray>& utf8s)
+{
+    if(!hasPhraseCache() || !d->m_voice.isEmpty())
+        return;
+    QList<QByteArray> keys;
+    foreach(const QByteArray &utf8, utf8s)
+        if(!utf8.isEmpty() && utf8.size() <= s_maxPhraseLength)
+            keys.append(Private::phraseKey(utf8, d->m_voiceType, d->m_rate, d->m_language));
+    QMutexLocker locker(&d->m_phraseMutex);
+    d->preparePhrases(keys);
+}
+
+QList<int> Speaker::phraseCacheStatistics() const
+{
+    QMutexLocker locker(&d->m_phraseMutex);
+    return QList<int>() << int(d->m_phraseHits) << int(d->m_phraseMisses) << d->m_phrases.count() << d->m_phrases.totalCost() / 1024;
+}
+
+void Speaker::catalogueFetched()
+{
+    {
+        QMutexLocker locker(&d->m_catalogueMutex);
+        d->m_catalogue = d->m_catalogueWatcher.result();
+    }
+    emit catalogueChanged();
+}
+
+QStringList Speaker::modules() const
+{
+    QMutexLocker locker(&d->m_catalogueMutex);
+    return d->m_catalogue.m_modules;
+}
+
+KAccessibleVoiceList Speaker::voices() const
+{
+    QMutexLocker locker(&d->m_catalogueMutex);
+    return d->m_catalogue.m_voices;
+}
+
+KAccessibleVoiceList Speaker::voices(const QString &language, const QString &variant) const
+{
+    QMutexLocker locker(&d->m_catalogueMutex);
+    KAccessibleVoiceList result;
+    foreach(int i, d->m_catalogue.m_byLanguage.value(language))
+        if(variant.isEmpty() || d->m_catalogue.m_voices[i].variant == variant)
+            result.append(d->m_catalogue.m_voices[i]);
+    return result;
+}
+
+QStringList Speaker::languages() const
+{
+    QMutexLocker locker(&d->m_catalogueMutex);
+    return d->m_catalogue.m_languages;
+}
+
+QString Speaker::voice() const
+{
+    return d->m_voice;
+}
+
+bool Speaker::setVoice(const QString &name)
+{
+    d->m_voice = name;
+    if(name.isEmpty()) {
+        setVoiceType(d->m_voiceType);
+        return true;
+    }
+#if defined(SPEECHD_FOUND)
+    if(d->m_echoConnection)
+        spd_set_synthesis_voice(d->m_echoConnection, name.toUtf8().constData());
+    if(d->m_connection)
+        return spd_set_synthesis_voice(d->m_connection, name.toUtf8().constData()) == 0;
+#endif
+    return false;
+}
+
+int Speaker::voiceType() const
+{
+    return d->m_voiceType;
+}
+
+int Speaker::backlog() const
+{
+    QMutexLocker locker(&d->m_mutex);
+    return d->m_sayStack.count() + (isSpeaking() ? 1 : 0);
+}
+
+int Speaker::averageDuration() const
+{
+    return d->m_averageDuration;
+}
+
+int Speaker::rate() const
+{
+    return d->m_rate;
+}
+
+void Speaker::setRate(int rate)
+{
+    d->m_rate = qBound(-100, rate, 100);
+#if defined(SPEECHD_FOUND)
+    if(d->m_connection) {
+        spd_set_voice_rate(d->m_connection, d->m_rate);
+    }
+    if(d->m_echoConnection) {
+        spd_set_voice_rate(d->m_echoConnection, d->m_rate);
+    }
+#endif
+}
+
+QString Speaker::language() const
+{
+    return QString::fromLatin1(d->m_language);
+}
+
+void Speaker::setLanguage(const QString &language)
+{
+    d->m_language = language.section(QLatin1Char('_'), 0, 0).toLower().toLatin1();
+#if defined(SPEECHD_FOUND)
+    if(d->m_connection && !d->m_language.isEmpty())
+        spd_set_language(d->m_connection, d->m_language.constData());
+    if(d->m_echoConnection && !d->m_language.isEmpty())
+        spd_set_language(d->m_echoConnection, d->m_language.constData());
+#endif
+}
+
+void Speaker::setVoiceType(int type)
+{
+    d->m_voiceType = type;
+#if defined(SPEECHD_FOUND)
+    if(d->m_connection) {
+        spd_set_voice_type_all(d->m_connection, (SPDVoiceType) type);
+    }
+    if(d->m_echoConnection) {
+        spd_set_voice_type(d->m_echoConnection, (SPDVoiceType) type);
+    }
+#endif
+}
+
+/**
+ * Built-in pronunciation rules. The language is matched against the full name of
+ * the locale, e.g. de_DE, and against the language alone, e.g. de. The abbreviations
+ * are matched case-insensitive and only as whole words.
+ */
+static const struct {
+    const char *language;
+    const char *abbreviation;
+    const char *replacement;
+} s_pronunciationRules[] = {
+    { "en", "e.g.", "for example" },
+    { "en", "i.e.", "that is" },
+    { "en", "etc.", "et cetera" },
+    { "en", "approx.", "approximately" },
+    { "en", "ctrl", "control" },
+    { "en", "esc", "escape" },
+    { "en", "del", "delete" },
+    { "en", "ins", "insert" },
+    { "en", "pgup", "page up" },
+    { "en", "pgdn", "page down" },
+    { "en", "dir", "directory" },
+    { "en", "config", "configuration" },
+    { "de", "z.b.", "zum Beispiel" },
+    { "de", "d.h.", "das heisst" },
+    { "de", "usw.", "und so weiter" },
+    { "de", "bzw.", "beziehungsweise" },
+    { "de", "ca.", "circa" },
+    { "de", "nr.", "Nummer" },
+    { "de", "strg", "Steuerung" },
+    { "de", "entf", "Entfernen" },
+    { "de", "einfg", "Einfuegen" },
+    { 0, 0, 0 }
+};
+
+/// Texts longer than that are not cached by the TextNormalizer.
+static const int s_maxCachedLength = 256;
+
+/// Texts longer than that are normalised in a worker thread, see Adaptor::sayText.
+static const int s_maxInlineNormalizeLength = 1024;
+
+/**
+ * Rewrites texts before they are spoken. Accelerator ampersands are removed, runs of
+ * the same punctuation collapsed, camelCase and snake_case identifiers split into
+ * words and abbreviations expanded using the pronunciation rules of the locale. The
+ * rules are compiled into a trie so a text is normalised in one pass no matter how
+ * many rules there are. The normalised UTF-8 of short texts like the names of menu
+ * items and buttons is kept in a LRU cache.
+ *
+ * The rules are read-only once loaded and the cache is locked, so texts can be
+ * normalised in any thread.
+ */
+class TextNormalizer
+{
+    public:
+        explicit TextNormalizer();
+
+        /**
+         * Returns the normalised \p text .
+         */
+        QString normalize(const QString &text) const;
+
+        /**
+         * Returns the normalised \p text as UTF-8. Short texts are served from the cache.
+         */
+        QByteArray utf8(const QString &text);
+
+        static TextNormalizer* instance();
+    private:
+        class Node
+        {
+            public:
+                QVector< QPair<QChar, int> > m_children; // sorted by the character
+                int m_replacement;
+                Node() : m_replacement(-1) {}
+        };
+        void addRule(const QString &abbreviation, const QString &replacement);
+        int child(int node, QChar c) const;
+        QString expand(const QString &text) const;
+
+        QVector<Node> m_nodes;
+        QStringList m_replacements;
+        QCache<QString, QByteArray> m_cache;
+        QMutex m_cacheMutex;
+};
+
+Q_GLOBAL_STATIC(TextNormalizer, textNormalizer)
+
+static bool charLessThan(const QPair<QChar, int> &pair, QChar c)
+{
+    return pair.first < c;
+}
+
+TextNormalizer::TextNormalizer()
+    : m_cache(512)
+{
+    m_nodes.append(Node());
+
+    // The Language in the Main group overwrites the locale, e.g. to match the voice.
+    const QString locale = Settings::instance()->value("Language", QLocale::system().name()).toString();
+    const QString language = locale.section(QLatin1Char('_'), 0, 0);
+    for(int i = 0; s_pronunciationRules[i].language; ++i) {
+        const QString ruleLanguage = QLatin1String( s_pronunciationRules[i].language );
+        if(ruleLanguage == locale || ruleLanguage == language)
+            addRule(QLatin1String( s_pronunciationRules[i].abbreviation ), QLatin1String( s_pronunciationRules[i].replacement ));
+    }
+
+    // Rules of the user are added last so they win over the built-in ones.
+    QMutexLocker locker(Settings::instance()->mutex());
+    KSharedConfig::Ptr config = Settings::instance()->config();
+    foreach(const QString &name, QStringList() << QLatin1String( "Pronunciation" ) << QLatin1String( "Pronunciation " ) + language << QLatin1String( "Pronunciation " ) + locale) {
+        const QMap<QString, QString> rules = config->group(name).entryMap();
+        for(QMap<QString, QString>::ConstIterator it = rules.constBegin(); it != rules.constEnd(); ++it)
+            addRule(it.key(), it.value());
+    }
+}
+
+TextNormalizer* TextNormalizer::instance()
+{
+    return textNormalizer();
+}
+
+int TextNormalizer::child(int node, QChar c) const
+{
+    const QVector< QPair<QChar, int> > &children = m_nodes.at(node).m_children;
+    QVector< QPair<QChar, int> >::ConstIterator it = qLowerBound(children.constBegin(), children.constEnd(), c, charLessThan);
+    return it != children.constEnd() && it->first == c ? it->second : -1;
+}
+
+void TextNormalizer::addRule(const QString &abbreviation, const QString &replacement)
+{
+    const QString key = abbreviation.toLower();
+    if(key.isEmpty())
+        return;
+    int node = 0;
+    foreach(const QChar &c, key) {
+        int next = child(node, c);
+        if(next < 0) {
+            next = m_nodes.count();
+            m_nodes.append(Node());
+            QVector< QPair<QChar, int> > &children = m_nodes[node].m_children;
+            children.insert(qLowerBound(children.begin(), children.end(), c, charLessThan), QPair<QChar, int>(c, next));
+        }
+        node = next;
+    }
+    if(m_nodes[node].m_replacement < 0) {
+        m_nodes[node].m_replacement = m_replacements.count();
+        m_replacements.append(replacement);
+    } else {
+        m_replacements[m_nodes[node].m_replacement] = replacement;
+    }
+}
+
+QString TextNormalizer::expand(const QString &text) const
+{
+    if(m_replacements.isEmpty())
+        return text;
+    QString result;
+    result.reserve(text.length());
+    const int length = text.length();
+    int i = 0;
+    while(i < length) {
+        // Abbreviations only start at the beginning of a word and take the longest match.
+        if(i == 0 || !text.at(i - 1).isLetterOrNumber()) {
+            int matchEnd = -1;
+            int matchReplacement = -1;
+            for(int node = 0, j = i; j < length; ++j) {
+                node = child(node, text.at(j).toLower());
+                if(node < 0)
+                    break;
+                const int replacement = m_nodes.at(node).m_replacement;
+                if(replacement >= 0 && (j + 1 == length || !text.at(j).isLetterOrNumber() || !text.at(j + 1).isLetterOrNumber())) {
+                    matchEnd = j + 1;
+                    matchReplacement = replacement;
+                }
+            }
+            if(matchReplacement >= 0) {
+                result += m_replacements.at(matchReplacement);
+                i = matchEnd;
+                continue;
+            }
+        }
+        result += text.at(i++);
+    }
+    return result;
+}
+
+QString TextNormalizer::normalize(const QString &text) const
+{
+    // Remove the accelerator markers first so "&Delete" is found as "Delete".
+    QString stripped;
+    if(text.contains(QLatin1Char('&'))) {
+        stripped.reserve(text.length());
+        for(int i = 0; i < text.length(); ++i) {
+            const QChar c = text.at(i);
+            if(c == QLatin1Char('&') && i + 1 < text.length()) {
+                if(text.at(i + 1) == QLatin1Char('&')) {
+                    stripped += c;
+                    ++i;
+                    continue;
+                }
+                if(text.at(i + 1).isLetterOrNumber())
+                    continue;
+            }
+            stripped += c;
+        }
+    } else {
+        stripped = text;
+    }
+
+    const QString expanded = expand(stripped);
+
+    QString result;
+    result.reserve(expanded.length());
+    QChar previous;
+    foreach(QChar c, expanded) {
+        if(c == QLatin1Char('_'))
+            c = QLatin1Char(' ');
+        if(c.isSpace()) {
+            if(!result.isEmpty() && !result.endsWith(QLatin1Char(' ')))
+                result += QLatin1Char(' ');
+        } else if(c == previous && (c.isPunct() || c.isSymbol())) {
+            // "!!!" or "-----" is spoken once.
+        } else {
+            if(c.isUpper() && previous.isLower())
+                result += QLatin1Char(' ');
+            result += c;
+        }
+        previous = c;
+    }
+    if(result.endsWith(QLatin1Char(' ')))
+        result.chop(1);
+    return result;
+}
+
+QByteArray TextNormalizer::utf8(const QString &text)
+{
+    if(text.length() > s_maxCachedLength)
+        return normalize(text).toUtf8();
+    {
+        QMutexLocker locker(&m_cacheMutex);
+        if(QByteArray *cached = m_cache.object(text))
+            return *cached;
+    }
+    const QByteArray result = normalize(text).toUtf8();
+    QMutexLocker locker(&m_cacheMutex);
+    m_cache.insert(text, new QByteArray(result));
+    return result;
+}
+
+/// Sentences longer than that, e.g. lines of a log without punctuation, are split at a space.
+static const int s_maxSentenceLength = 400;
+
+/// The number of sentences passed to the Speaker ahead of the one that is spoken.
+static const int s_readAhead = 3;
+
+/// The time an utterance is assumed to take as long as the Speaker did not measure it.
+static const int s_defaultUtteranceDuration = 1500;
+
+/// While streaming the SpeechReader asks for more sentences once less than that many
+/// milliseconds of speech are left. One request asks for twice as much, within bounds.
+static const int s_streamAheadMsecs = 10000;
+static const int s_minStreamRequest = 4;
+static const int s_maxStreamRequest = 64;
+
+static void appendSentence(QList<QByteArray> &sentences, const QString &text, int start, int end)
+{
+    while(start < end && text.at(start).isSpace())
+        ++start;
+    while(end > start && text.at(end - 1).isSpace())
+        --end;
+    if(end > start)
+        sentences.append(TextNormalizer::instance()->normalize(text.mid(start, end - start)).toUtf8());
+}
+
+/**
+ * Splits the \p text into sentences and returns them normalised as UTF-8. This is
+ * done in a worker thread.
+ */
+static QList<QByteArray> segmentSentences(const QString &text)
+{
+    QList<QByteArray> sentences;
+    QTextBoundaryFinder finder(QTextBoundaryFinder::Sentence, text);
+    int start = 0;
+    for(int end = finder.toNextBoundary(); end > start; end = finder.toNextBoundary()) {
+        while(end - start > s_maxSentenceLength) {
+            int cut = start + s_maxSentenceLength;
+            while(cut > start && !text.at(cut).isSpace())
+                --cut;
+            if(cut == start)
+                cut = start + s_maxSentenceLength;
+            appendSentence(sentences, text, start, cut);
+            start = cut;
+        }
+        appendSentence(sentences, text, start, end);
+        start = end;
+    }
+    return sentences;
+}
+
+class SpeechReader::Private
+{
+    public:
+        QList<QByteArray> m_sentences;
+        QFutureWatcher< QList<QByteArray> > m_segmenter;
+        bool m_segmenting;
+        bool m_streaming; // more sentences may be appended
+        bool m_requested; // more sentences were asked for and did not arrive yet
+        bool m_paused;
+        int m_position; // the sentence spoken right now
+        int m_next; // the next sentence passed to the Speaker
+        QList< QPair<int, int> > m_inFlight; // utterance id => sentence, oldest first
+        explicit Private() : m_segmenting(false), m_streaming(false), m_requested(false), m_paused(false), m_position(-1), m_next(0) {}
+};
+
+SpeechReader::SpeechReader(QObject *parent)
+    : QObject(parent)
+    , d(new Private)
+{
+    connect(&d->m_segmenter, SIGNAL(finished()), this, SLOT(segmented()));
+    connect(Speaker::instance(), SIGNAL(finished(int)), this, SLOT(utteranceFinished(int)));
+    connect(Speaker::instance(), SIGNAL(cancelled(int)), this, SLOT(utteranceCancelled(int)));
+}
+
+SpeechReader::~SpeechReader()
+{
+    d->m_segmenter.waitForFinished();
+    delete d;
+}
+
+void SpeechReader::read(const QString &text)
+{
+    stop();
+    d->m_segmenting = true;
+    d->m_segmenter.setFuture(QtConcurrent::run(segmentSentences, text));
+}
+
+void SpeechReader::readStream()
+{
+    stop();
+    d->m_streaming = true;
+    d->m_position = d->m_next = 0;
+    requestMore();
+}
+
+void SpeechReader::appendSentences(const QList<QByteArray> &sentences, bool last)
+{
+    if(!d->m_streaming)
+        return;
+    d->m_requested = false;
+    d->m_sentences += sentences;
+    d->m_streaming = !last;
+    if(d->m_position >= d->m_sentences.count() && !d->m_streaming) {
+        stop();
+        emit finished();
+        return;
+    }
+    if(!sentences.isEmpty())
+        emit positionChanged(d->m_position, d->m_sentences.count());
+    feed();
+}
+
+void SpeechReader::requestMore()
+{
+    if(!d->m_streaming || d->m_requested)
+        return;
+    // The faster the speech the more sentences are asked for ahead.
+    const int duration = qMax(1, Speaker::instance()->averageDuration() > 0 ? Speaker::instance()->averageDuration() : s_defaultUtteranceDuration);
+    const int ahead = qBound(s_minStreamRequest, s_streamAheadMsecs / duration, s_maxStreamRequest);
+    if(d->m_sentences.count() - d->m_position >= ahead)
+        return;
+    d->m_requested = true;
+    emit needMore(qMin(2 * ahead, s_maxStreamRequest));
+}
+
+void SpeechReader::segmented()
+{
+    if(!d->m_segmenting)
+        return;
+    d->m_segmenting = false;
+    d->m_sentences = d->m_segmenter.result();
+    d->m_position = d->m_next = 0;
+    if(d->m_sentences.isEmpty()) {
+        stop();
+        emit finished();
+        return;
+    }
+    emit positionChanged(d->m_position, d->m_sentences.count());
+    feed();
+}
+
+void SpeechReader::feed()
+{
+    if(d->m_paused || d->m_segmenting)
+        return;
+    Speaker *speaker = Speaker::instance();
+    if(!speaker->isConnected() && !speaker->reconnect())
+        return;
+    while(d->m_inFlight.count() < s_readAhead && d->m_next < d->m_sentences.count()) {
+        const int id = speaker->append(d->m_sentences.at(d->m_next));
+        if(!id)
+            break;
+        d->m_inFlight.append(QPair<int, int>(id, d->m_next));
+        ++d->m_next;
+    }
+    requestMore();
+}
+
+void SpeechReader::drop()
+{
+    // The sentences are forgotten before they are removed so their cancelled signal is ignored.
+    QList<int> ids;
+    for(int i = 0; i < d->m_inFlight.count(); ++i)
+        ids.append(d->m_inFlight.at(i).first);
+    d->m_inFlight.clear();
+    d->m_next = d->m_position;
+    if(!ids.isEmpty())
+        Speaker::instance()->remove(ids);
+}
+
+void SpeechReader::utteranceFinished(int id)
+{
+    if(d->m_inFlight.isEmpty() || d->m_inFlight.first().first != id)
+        return;
+    d->m_position = d->m_inFlight.takeFirst().second + 1;
+    if(d->m_position >= d->m_sentences.count()) {
+        // While streaming the reading goes on once more sentences arrived.
+        if(d->m_streaming) {
+            requestMore();
+            return;
+        }
+        stop();
+        emit finished();
+        return;
+    }
+    emit positionChanged(d->m_position, d->m_sentences.count());
+    feed();
+}
+
+void SpeechReader::utteranceCancelled(int id)
+{
+    // Continue with the oldest sentence not finished yet, the one that got interrupted.
+    for(int i = 0; i < d->m_inFlight.count(); ++i) {
+        if(d->m_inFlight.at(i).first == id) {
+            d->m_position = d->m_inFlight.first().second;
+            drop();
+            d->m_paused = true;
+            emit positionChanged(d->m_position, d->m_sentences.count());
+            return;
+        }
+    }
+}
+
+void SpeechReader::pause()
+{
+    if(!isReading() || d->m_paused)
+        return;
+    d->m_paused = true;
+    drop();
+}
+
+void SpeechReader::resume()
+{
+    if(!d->m_paused)
+        return;
+    d->m_paused = false;
+    feed();
+}
+
+void SpeechReader::skip(int sentences)
+{
+    if(d->m_sentences.isEmpty() || sentences == 0)
+        return;
+    drop();
+    d->m_position = d->m_next = qBound(0, d->m_position + sentences, d->m_sentences.count() - 1);
+    emit positionChanged(d->m_position, d->m_sentences.count());
+    feed();
+}
+
+void SpeechReader::stop()
+{
+    drop();
+    d->m_segmenting = false;
+    d->m_streaming = false;
+    d->m_requested = false;
+    d->m_paused = false;
+    d->m_sentences.clear();
+    d->m_position = -1;
+    d->m_next = 0;
+}
+
+bool SpeechReader::isReading() const
+{
+    return d->m_segmenting || d->m_streaming || !d->m_sentences.isEmpty();
+}
+
+bool SpeechReader::isPaused() const
+{
+    return d->m_paused;
+}
+
+int SpeechReader::position() const
+{
+    return d->m_position;
+}
+
+int SpeechReader::count() const
+{
+    return d->m_segmenting ? -1 : d->m_sentences.count();
+}
+
+/// The TreeMirror of an application ignores new nodes once it holds that many.
+static const int s_maxTreeNodes = 100000;
+
+/**
+ * The accessible tree of an application as published by its bridge while the
+ * KAccessibleTreeSync feature is enabled. The nodes live in one arena and are linked
+ * by their position in it. The slots of removed nodes are reused. Nodes that arrive
+ * before their parent wait as orphans till the parent arrives.
+ */
+class TreeMirror
+{
+    public:
+        explicit TreeMirror() : m_firstRoot(-1), m_free(-1) {}
+
+        void clear()
+        {
+            m_nodes.clear();
+            m_index.clear();
+            m_orphans.clear();
+            m_firstRoot = m_free = -1;
+        }
+
+        int count() const { return m_index.count(); }
+
+        /// Adds the \p node or updates it, which may move it to another parent.
+        void update(const KAccessibleNode &node)
+        {
+            int i = m_index.value(node.handle, -1);
+            if(i >= 0) {
+                Node &n = m_nodes[i];
+                const bool moved = n.m_node.parent != node.parent || n.m_node.index != node.index;
+                if(moved)
+                    unlink(i);
+                n.m_node = node;
+                if(moved)
+                    link(i);
+                return;
+            }
+            if(m_index.count() >= s_maxTreeNodes)
+                return;
+            if(m_free >= 0) {
+                i = m_free;
+                m_free = m_nodes[i].m_next;
+            } else {
+                i = m_nodes.count();
+                m_nodes.append(Node());
+            }
+            Node &n = m_nodes[i];
+            n.m_node = node;
+            n.m_parent = n.m_firstChild = n.m_next = -1;
+            m_index.insert(node.handle, i);
+            link(i);
+            foreach(int orphan, m_orphans.values(node.handle)) {
+                m_orphans.remove(node.handle, orphan);
+                link(orphan);
+            }
+        }
+
+        /// Removes the node with the \p handle together with all its descendants.
+        void remove(qulonglong handle)
+        {
+            const int i = m_index.value(handle, -1);
+            if(i < 0)
+                return;
+            unlink(i);
+            QList<int> pending;
+            pending.append(i);
+            while(!pending.isEmpty()) {
+                const int j = pending.takeLast();
+                for(int child = m_nodes[j].m_firstChild; child >= 0; child = m_nodes[child].m_next)
+                    pending.append(child);
+                m_index.remove(m_nodes[j].m_node.handle);
+                m_nodes[j] = Node();
+                m_nodes[j].m_next = m_free;
+                m_free = j;
+            }
+        }
+
+        bool node(qulonglong handle, KAccessibleNode &node) const
+        {
+            const int i = m_index.value(handle, -1);
+            if(i < 0)
+                return false;
+            node = m_nodes[i].m_node;
+            return true;
+        }
+
+        /// Returns the children of the node with the \p handle or the roots if 0.
+        KAccessibleNodeList children(qulonglong handle) const
+        {
+            KAccessibleNodeList result;
+            int child = m_firstRoot;
+            if(handle) {
+                const int i = m_index.value(handle, -1);
+                if(i < 0)
+                    return result;
+                child = m_nodes[i].m_firstChild;
+            }
+            for(; child >= 0; child = m_nodes[child].m_next)
+                result.append(m_nodes[child].m_node);
+            return result;
+        }
+
+    private:
+        class Node
+        {
+            public:
+                KAccessibleNode m_node;
+                int m_parent;
+                int m_firstChild;
+                int m_next; // the next sibling or the next free slot
+                Node() : m_parent(-1), m_firstChild(-1), m_next(-1) {}
+        };
+
+        /// Inserts the node \p i into the children of its parent ordered by the index.
+        void link(int i)
+        {
+            Node &n = m_nodes[i];
+            int *first = &m_firstRoot;
+            if(n.m_node.parent) {
+                const int parent = m_index.value(n.m_node.parent, -1);
+                if(parent < 0) {
+                    n.m_parent = -1;
+                    m_orphans.insert(n.m_node.parent, i);
+                    return;
+                }
+                n.m_parent = parent;
+                first = &m_nodes[parent].m_firstChild;
+            }
+            int *link = first;
+            while(*link >= 0 && m_nodes[*link].m_node.index <= n.m_node.index)
+                link = &m_nodes[*link].m_next;
+            n.m_next = *link;
+            *link = i;
+        }
+
+        void unlink(int i)
+        {
+            Node &n = m_nodes[i];
+            if(n.m_node.parent && n.m_parent < 0) {
+                m_orphans.remove(n.m_node.parent, i);
+                return;
+            }
+            int *link = n.m_parent >= 0 ? &m_nodes[n.m_parent].m_firstChild : &m_firstRoot;
+            while(*link >= 0 && *link != i)
+                link = &m_nodes[*link].m_next;
+            if(*link == i)
+                *link = n.m_next;
+            n.m_next = -1;
+            n.m_parent = -1;
+        }
+
+        QVector<Node> m_nodes;
+        QHash<qulonglong, int> m_index;
+        QMultiHash<qulonglong, int> m_orphans; // parent handle => waiting nodes
+        int m_firstRoot;
+        int m_free;
+};
+
+/**
+ * What we know about an application that sends us events. The record is created
+ * for the unique dbus name of the sender on its first message and removed once the
+ * sender leaves the bus, see SourceTable.
+ */
+class Source
+{
+    public:
+        const QString m_service;
+        uint m_pid;
+        QString m_application;
+        bool m_isBridge;
+        KAccessibleFocus m_lastFocus;
+        quint64 m_events;
+        QHash<int, quint64> m_counters;
+        QSet<QString> m_strings;
+        /// The interned class names, only those are kept by Adaptor::saveState .
+        QSet<QString> m_classNames;
+        TreeMirror *m_tree;
+        Source *m_previous;
+        Source *m_next;
+
+        explicit Source(const QString &service)
+            : m_service(service), m_pid(0), m_application(service), m_isBridge(false), m_events(0), m_tree(0), m_previous(0), m_next(0) {}
+        ~Source() { delete m_tree; }
+
+        /**
+         * Returns the shared instance of \p string so the class names and the like of all
+         * the events and focus records we keep share their data.
+         */
+        QString intern(const QString &string)
+        {
+            if(string.isEmpty())
+                return string;
+            QSet<QString>::const_iterator it = m_strings.constFind(string);
+            if(it != m_strings.constEnd())
+                return *it;
+            if(m_strings.count() < 1024)
+                m_strings.insert(string);
+            return string;
+        }
+
+        QString internClassName(const QString &className)
+        {
+            const QString string = intern(className);
+            if(!string.isEmpty() && m_classNames.count() < 256)
+                m_classNames.insert(string);
+            return string;
+        }
+
+        void count(int reason)
+        {
+            ++m_events;
+            ++m_counters[reason];
+        }
+};
+
+/**
+ * The table of \a Source records keyed by the unique dbus name of the sender. Lookups
+ * are done in constant time. If the table is full the least recently used record is
+ * evicted.
+ */
+class SourceTable
+{
+    public:
+        explicit SourceTable(int capacity) : m_capacity(capacity), m_first(0), m_last(0) {}
+        ~SourceTable() { qDeleteAll(m_sources); }
+
+        QList<Source*> sources() const { return m_sources.values(); }
+
+        /// Returns the source for the \p service and marks it as most recently used.
+        Source* find(const QString &service)
+        {
+            Source *source = m_sources.value(service);
+            if(source && source != m_first) {
+                unlink(source);
+                prepend(source);
+            }
+            return source;
+        }
+
+        /**
+         * Adds a new source for the \p service . If that evicts the least recently used
+         * source then that one is returned and the caller owns it.
+         */
+        Source* insert(Source *source)
+        {
+            m_sources.insert(source->m_service, source);
+            prepend(source);
+            if(m_sources.count() <= m_capacity)
+                return 0;
+            Source *evicted = m_last;
+            unlink(evicted);
+            m_sources.remove(evicted->m_service);
+            return evicted;
+        }
+
+        void remove(const QString &service)
+        {
+            if(Source *source = m_sources.take(service)) {
+                unlink(source);
+                delete source;
+            }
+        }
+
+    private:
+        void prepend(Source *source)
+        {
+            source->m_previous = 0;
+            source->m_next = m_first;
+            if(m_first) m_first->m_previous = source;
+            m_first = source;
+            if(!m_last) m_last = source;
+        }
+
+        void unlink(Source *source)
+        {
+            if(source->m_previous) source->m_previous->m_next = source->m_next;
+            else m_first = source->m_next;
+            if(source->m_next) source->m_next->m_previous = source->m_previous;
+            else m_last = source->m_previous;
+            source->m_previous = source->m_next = 0;
+        }
+
+        const int m_capacity;
+        QHash<QString, Source*> m_sources;
+        Source *m_first;
+        Source *m_last;
+};
+
+static bool sourceEventsGreaterThan(const Source *a, const Source *b)
+{
+    return a->m_events > b->m_events;
+}
+
+/// A client subscribed to events with Adaptor::subscribe.
+class Subscription
+{
+    public:
+        int m_id;
+        QString m_service;
+        QString m_path;
+        QSet<int> m_reasons;
+        int m_fields;
+        int m_minInterval;
+        QString m_application;
+        KAccessibleEventList m_pending;
+        QBasicTimer m_timer;
+
+        bool matches(int reason, const Source *source) const
+        {
+            if(!m_reasons.isEmpty() && !m_reasons.contains(reason))
+                return false;
+            return m_application.isEmpty() || (source && (m_application == source->m_application || m_application == source->m_service));
+        }
+
+        void add(const KAccessibleEvent &event)
+        {
+            if(event.reason == QAccessible::Focus) {
+                for(int i = m_pending.count() - 1; i >= 0; --i)
+                    if(m_pending[i].reason == QAccessible::Focus)
+                        m_pending.removeAt(i);
+            }
+            m_pending.append(event);
+            m_pending.last().iface.strip(m_fields);
+        }
+
+        void flush(QDBusConnection &connection)
+        {
+            if(m_pending.isEmpty())
+                return;
+            QDBusMessage message = QDBusMessage::createMethodCall(m_service, m_path, QLatin1String( "org.kde.kaccessibleapp.Client" ), QLatin1String( "notify" ));
+            message << qVariantFromValue(m_pending);
+            connection.send(message);
+            m_pending.clear();
+        }
+};
+
+/// An event received from a bridge that waits to be processed, see InboundScheduler.
+class InboundEvent
+{
+    public:
+        int m_reason;
+        KAccessibleInterface m_iface;
+        QString m_service;
+        /// Set on changes that arrived before a newer focus, they are not said anymore.
+        bool m_isSilent;
+        explicit InboundEvent() : m_reason(0), m_isSilent(false) {}
+        InboundEvent(int reason, const KAccessibleInterface &iface, const QString &service) : m_reason(reason), m_iface(iface), m_service(service), m_isSilent(false) {}
+};
+
+/// Identifies queued changes of the same kind for the same object.
+typedef QPair<QString, QPair<qulonglong, int> > InboundKey;
+
+/**
+ * The events received from the bridges are queued per reason and processed in the
+ * order of their importance rather than the order they arrived in. Alerts are
+ * processed first, then the focus and then the value changes. Only the latest focus
+ * is kept and a value or name change replaces a queued one for the same object, so
+ * superseded work is dropped before it gets processed. Changes queued before a focus
+ * are still dispatched but not said, they would be heard after the newer focus.
+ */
+class InboundScheduler
+{
+    public:
+        explicit InboundScheduler() : m_hasFocus(false), m_valueHead(0) {}
+
+        bool isEmpty() const { return m_alerts.isEmpty() && !m_hasFocus && m_valueHead >= m_values.count(); }
+        bool hasUrgent() const { return !m_alerts.isEmpty() || m_hasFocus; }
+
+        void enqueue(const InboundEvent &event)
+        {
+            switch(event.m_reason) {
+                case QAccessible::Alert:
+                    m_alerts.enqueue(event);
+                    break;
+                case QAccessible::Focus:
+                    m_focus = event;
+                    m_hasFocus = true;
+                    for(int i = m_valueHead; i < m_values.count(); ++i)
+                        m_values[i].m_isSilent = true;
+                    break;
+                default: {
+                    if(event.m_iface.handle) {
+                        const InboundKey key(event.m_service, qMakePair(event.m_iface.handle, event.m_reason));
+                        QHash<InboundKey, int>::Iterator it = m_valueIndex.find(key);
+                        if(it != m_valueIndex.end()) {
+                            m_values[it.value()].m_reason = 0; // superseded
+                            it.value() = m_values.count();
+                        } else {
+                            m_valueIndex.insert(key, m_values.count());
+                        }
+                    }
+                    m_values.append(event);
+                } break;
+            }
+        }
+
+        /// Takes the next event that should be processed. Returns false if there is none.
+        bool take(InboundEvent &event)
+        {
+            if(!m_alerts.isEmpty()) {
+                event = m_alerts.dequeue();
+                return true;
+            }
+            if(m_hasFocus) {
+                event = m_focus;
+                m_focus = InboundEvent();
+                m_hasFocus = false;
+                return true;
+            }
+            while(m_valueHead < m_values.count()) {
+                InboundEvent &e = m_values[m_valueHead++];
+                if(!e.m_reason)
+                    continue;
+                if(e.m_iface.handle)
+                    m_valueIndex.remove(InboundKey(e.m_service, qMakePair(e.m_iface.handle, e.m_reason)));
+                event = e;
+                break;
+            }
+            if(m_valueHead >= m_values.count()) {
+                m_values.clear();
+                m_valueHead = 0;
+            }
+            return event.m_reason != 0;
+        }
+
+    private:
+        QQueue<InboundEvent> m_alerts;
+        InboundEvent m_focus;
+        bool m_hasFocus;
+        QList<InboundEvent> m_values;
+        QHash<InboundKey, int> m_valueIndex;
+        int m_valueHead;
+};
+
+/**
+ * What is said about the focused object. It is held back for the MergeWindow so name
+ * and value changes of that object that follow the focus are said together with it.
+ */
+class PendingUtterance
+{
+    public:
+        QString m_service;
+        qulonglong m_handle;
+        QString m_name;
+        int m_role;
+        QString m_value;
+        QString m_description;
+        QString m_accelerator;
+        bool m_isPending;
+        explicit PendingUtterance() : m_handle(0), m_role(QAccessible::NoRole), m_isPending(false) {}
+
+        bool isFor(const KAccessibleInterface &iface, const QString &service) const
+        {
+            return m_isPending && iface.handle && iface.handle == m_handle && service == m_service;
+        }
+};
+
+/**
+ * Returns how the \p role is spoken or an empty string for roles that are not worth
+ * mentioning, e.g. windows and panes.
+ */
+static QString spokenRole(int role)
+{
+    switch(role) {
+        case QAccessible::PushButton: return i18nc("spoken role of a widget", "button");
+        case QAccessible::ButtonMenu: return i18nc("spoken role of a widget", "menu button");
+        case QAccessible::ButtonDropDown: return i18nc("spoken role of a widget", "drop down button");
+        case QAccessible::CheckBox: return i18nc("spoken role of a widget", "check box");
+        case QAccessible::RadioButton: return i18nc("spoken role of a widget", "radio button");
+        case QAccessible::ComboBox: return i18nc("spoken role of a widget", "combo box");
+        case QAccessible::SpinBox: return i18nc("spoken role of a widget", "spin box");
+        case QAccessible::Slider: return i18nc("spoken role of a widget", "slider");
+        case QAccessible::Dial: return i18nc("spoken role of a widget", "dial");
+        case QAccessible::ScrollBar: return i18nc("spoken role of a widget", "scroll bar");
+        case QAccessible::ProgressBar: return i18nc("spoken role of a widget", "progress bar");
+        case QAccessible::EditableText: return i18nc("spoken role of a widget", "edit");
+        case QAccessible::PageTab: return i18nc("spoken role of a widget", "tab");
+        case QAccessible::Link: return i18nc("spoken role of a widget", "link");
+        case QAccessible::MenuItem: return i18nc("spoken role of a widget", "menu item");
+        default: return QString();
+    }
+}
+
+/// The edge length in pixels of the cells of the SpatialGrid.
+static const int s_gridCellSize = 64;
+
+/// Rects are clipped to that many cells per direction so a huge rect can't flood the grid.
+static const int s_maxGridCells = 128;
+
+/// The SpatialGrid ignores new objects once it holds that many.
+static const int s_maxGridObjects = 65536;
+
+/**
+ * Indexes the rects of the objects reported by the bridges so hitTest and objectsInRect
+ * are answered without asking the applications. The screen is divided into cells of
+ * s_gridCellSize pixels and each cell lists the objects overlapping it. Updating an
+ * object only touches the cells of its old and its new rect.
+ */
+class SpatialGrid
+{
+    public:
+        explicit SpatialGrid() : m_lastId(0), m_sequence(0) {}
+
+        /**
+         * Adds or moves the \p object . An object with an empty rect is removed, if its
+         * child index is 0 together with all its child elements.
+         */
+        void update(const KAccessibleObject &object)
+        {
+            const Key key(object.source, object.handle);
+            if(object.rect.isEmpty()) {
+                if(quint32(object.handle)) {
+                    remove(m_ids.value(key));
+                } else {
+                    foreach(int id, m_objects.values(ObjectKey(object.source, quint32(object.handle >> 32))))
+                        remove(id);
+                }
+                return;
+            }
+            int id = m_ids.value(key);
+            if(id) {
+                Entry &entry = m_entries[id];
+                if(entry.m_object.rect != object.rect) {
+                    removeCells(id, entry.m_object.rect);
+                    insertCells(id, object.rect);
+                }
+                entry.m_object = object;
+                entry.m_sequence = ++m_sequence;
+                return;
+            }
+            if(m_entries.count() >= s_maxGridObjects)
+                return;
+            id = ++m_lastId;
+            Entry entry;
+            entry.m_object = object;
+            entry.m_sequence = ++m_sequence;
+            m_entries.insert(id, entry);
+            m_ids.insert(key, id);
+            m_objects.insert(ObjectKey(object.source, quint32(object.handle >> 32)), id);
+            insertCells(id, object.rect);
+        }
+
+        /// Removes all objects of the application with the dbus \p service .
+        void removeSource(const QString &service)
+        {
+            QList<int> ids;
+            for(QHash<int, Entry>::ConstIterator it = m_entries.constBegin(); it != m_entries.constEnd(); ++it)
+                if(it.value().m_object.source == service)
+                    ids.append(it.key());
+            foreach(int id, ids)
+                remove(id);
+        }
+
+        /**
+         * Returns the smallest object that contains the \p point . Of objects with the same
+         * size the one updated last wins, that is most likely the one on top.
+         */
+        KAccessibleObject hitTest(const QPoint &point) const
+        {
+            // The entries are referred to by iterator, the const operator[] returns a copy.
+            QHash<int, Entry>::ConstIterator best = m_entries.constEnd();
+            qint64 bestArea = 0;
+            foreach(int id, m_cells.value(cellKey(cell(point.x()), cell(point.y())))) {
+                QHash<int, Entry>::ConstIterator it = m_entries.constFind(id);
+                if(it == m_entries.constEnd())
+                    continue;
+                const QRect &rect = it.value().m_object.rect;
+                if(!rect.contains(point))
+                    continue;
+                const qint64 area = qint64(rect.width()) * rect.height();
+                if(best == m_entries.constEnd() || area < bestArea || (area == bestArea && it.value().m_sequence > best.value().m_sequence)) {
+                    best = it;
+                    bestArea = area;
+                }
+            }
+            return best != m_entries.constEnd() ? best.value().m_object : KAccessibleObject();
+        }
+
+        /// Returns the objects that intersect the \p rect .
+        KAccessibleObjectList objectsInRect(const QRect &rect) const
+        {
+            KAccessibleObjectList result;
+            QSet<int> seen;
+            const QRect range = cellRange(rect);
+            for(int x = range.left(); x <= range.right(); ++x) {
+                for(int y = range.top(); y <= range.bottom(); ++y) {
+                    QHash<qint64, QVector<int> >::ConstIterator it = m_cells.constFind(cellKey(x, y));
+                    if(it == m_cells.constEnd())
+                        continue;
+                    foreach(int id, it.value()) {
+                        if(seen.contains(id))
+                            continue;
+                        seen.insert(id);
+                        QHash<int, Entry>::ConstIterator entry = m_entries.constFind(id);
+                        if(entry != m_entries.constEnd() && entry.value().m_object.rect.intersects(rect))
+                            result.append(entry.value().m_object);
+                    }
+                }
+            }
+            return result;
+        }
+
+        int count() const { return m_entries.count(); }
+
+    private:
+        typedef QPair<QString, qulonglong> Key;
+        typedef QPair<QString, quint32> ObjectKey;
+        class Entry
+        {
+            public:
+                KAccessibleObject m_object;
+                quint64 m_sequence;
+        };
+
+        static int cell(int coordinate)
+        {
+            return coordinate >= 0 ? coordinate / s_gridCellSize : (coordinate + 1) / s_gridCellSize - 1;
+        }
+        static qint64 cellKey(int x, int y)
+        {
+            return (qint64(x) << 32) | quint32(y);
+        }
+        static QRect cellRange(const QRect &rect)
+        {
+            const int left = cell(rect.left());
+            const int top = cell(rect.top());
+            return QRect(QPoint(left, top), QPoint(qMin(cell(rect.right()), left + s_maxGridCells - 1), qMin(cell(rect.bottom()), top + s_maxGridCells - 1)));
+        }
+
+        void insertCells(int id, const QRect &rect)
+        {
+            const QRect range = cellRange(rect);
+            for(int x = range.left(); x <= range.right(); ++x)
+                for(int y = range.top(); y <= range.bottom(); ++y)
+                    m_cells[cellKey(x, y)].append(id);
+        }
+
+        void removeCells(int id, const QRect &rect)
+        {
+            const QRect range = cellRange(rect);
+            for(int x = range.left(); x <= range.right(); ++x) {
+                for(int y = range.top(); y <= range.bottom(); ++y) {
+                    QHash<qint64, QVector<int> >::Iterator it = m_cells.find(cellKey(x, y));
+                    if(it == m_cells.end())
+                        continue;
+                    const int index = it.value().indexOf(id);
+                    if(index >= 0)
+                        it.value().remove(index);
+                    if(it.value().isEmpty())
+                        m_cells.erase(it);
+                }
+            }
+        }
+
+        void remove(int id)
+        {
+            QHash<int, Entry>::Iterator it = m_entries.find(id);
+            if(it == m_entries.end())
+                return;
+            const KAccessibleObject &object = it.value().m_object;
+            removeCells(id, object.rect);
+            m_ids.remove(Key(object.source, object.handle));
+            m_objects.remove(ObjectKey(object.source, quint32(object.handle >> 32)), id);
+            m_entries.erase(it);
+        }
+
+        QHash<int, Entry> m_entries;
+        QHash<Key, int> m_ids;
+        QMultiHash<ObjectKey, int> m_objects; // the object of a handle => it and its child elements
+        QHash<qint64, QVector<int> > m_cells;
+        int m_lastId;
+        quint64 m_sequence;
+};
+
+/**
+ * Keeps the lag of the speech behind the user interface bounded. The lag is estimated
+ * from the backlog of the Speaker and the time an utterance takes. The longer the lag
+ * the less is said about an object. Above the maximal lag the speech rate is raised
+ * till the backlog drained.
+ */
+class VerbosityController
+{
+    public:
+        enum Level {
+            Full = 0,
+            NoDescription,
+            NoAccelerator,
+            NoRole
+        };
+
+        int m_maxLag;
+        int m_rateBoost;
+        int m_level;
+        bool m_boosted;
+        explicit VerbosityController() : m_maxLag(0), m_rateBoost(0), m_level(Full), m_boosted(false) {}
+
+        /// Updates the level and the boost. Returns true if the boost got switched on or off.
+        bool update(int backlog, int averageDuration)
+        {
+            if(m_maxLag <= 0)
+                return false;
+            const int lag = backlog * (averageDuration > 0 ? averageDuration : s_defaultUtteranceDuration);
+            m_level = qMin(lag * 4 / m_maxLag, int(NoRole));
+            // Once boosted the rate stays raised till the lag is back to where everything is said.
+            const bool boosted = m_boosted ? lag * 4 >= m_maxLag : lag > m_maxLag;
+            if(boosted == m_boosted)
+                return false;
+            m_boosted = boosted;
+            return true;
+        }
+};
+
+/**
+ * What a profile decided about an event: if anything is said, which fields in which
+ * order and with which priority.
+ */
+class ProfileDecision
+{
+    public:
+        enum Field {
+            Name = 0,
+            Role,
+            Value,
+            Description,
+            Accelerator
+        };
+
+        bool m_speak;
+        QVector<int> m_fields;
+        Speaker::Priority m_priority;
+        explicit ProfileDecision() : m_speak(true), m_priority(Speaker::Text) {}
+        ProfileDecision(int field, Speaker::Priority priority) : m_speak(true), m_priority(priority) { m_fields.append(field); }
+
+        /**
+         * Returns the fields of the object joined, e.g. "Volume, slider, 40%". The
+         * higher the verbosity \p level the less is said and texts already said are
+         * not repeated.
+         */
+        QString compose(const QString &name, int role, const QString &value, const QString &description, const QString &accelerator, int level) const
+        {
+            QStringList parts;
+            foreach(int field, m_fields) {
+                QString text;
+                switch(field) {
+                    case Name: text = name; break;
+                    case Role: if(level < VerbosityController::NoRole) text = spokenRole(role); break;
+                    case Value: text = value; break;
+                    case Description: if(level < VerbosityController::NoDescription) text = description; break;
+                    case Accelerator: if(level < VerbosityController::NoAccelerator) text = accelerator; break;
+                }
+                if(!text.isEmpty() && !parts.contains(text))
+                    parts << text;
+            }
+            return parts.join(QLatin1String( ", " ));
+        }
+};
+
+/// The application, the class name and the reason a decision is made for.
+typedef QPair<QString, QPair<QString, int> > ProfileKey;
+
+/**
+ * The profiles of the user compiled into one hash. A profile is the [Profile] group of
+ * the config, used for all applications, or a [Profile <application>] group. Its entries
+ * map a reason and optionally a class name to the fields said, e.g.
+ *
+ * \code
+ * Focus QLineEdit=name,value
+ * ValueChanged QProgressBar=none
+ * Alert=name,description;Important
+ * \endcode
+ *
+ * An event is decided by at most four lookups, from the most specific to the most
+ * general rule, and reasons without any rule by one.
+ */
+class ProfileTable
+{
+    public:
+        explicit ProfileTable()
+        {
+            m_defaults.insert(QAccessible::Focus, ProfileDecision(ProfileDecision::Name, Speaker::Text));
+            m_defaults[QAccessible::Focus].m_fields << ProfileDecision::Role << ProfileDecision::Value << ProfileDecision::Description << ProfileDecision::Accelerator;
+            m_defaults.insert(QAccessible::ValueChanged, ProfileDecision(ProfileDecision::Value, Speaker::Text));
+            m_defaults.insert(QAccessible::NameChanged, ProfileDecision(ProfileDecision::Name, Speaker::Text));
+            m_defaults.insert(QAccessible::Alert, ProfileDecision(ProfileDecision::Name, Speaker::Message));
+            m_silent.m_speak = false;
+        }
+
+        /// Compiles the profiles of the config, replacing the ones loaded before.
+        void load()
+        {
+            m_table.clear();
+            m_reasons.clear();
+            QMutexLocker locker(Settings::instance()->mutex());
+            KSharedConfig::Ptr config = Settings::instance()->config();
+            const QString prefix = QLatin1String( "Profile" );
+            foreach(const QString &group, config->groupList()) {
+                if(!group.startsWith(prefix) || (group.length() > prefix.length() && group.at(prefix.length()) != QLatin1Char(' ')))
+                    continue;
+                const QString application = group.mid(prefix.length()).trimmed();
+                const QMap<QString, QString> rules = config->group(group).entryMap();
+                for(QMap<QString, QString>::ConstIterator it = rules.constBegin(); it != rules.constEnd(); ++it)
+                    addRule(application, it.key().trimmed(), it.value());
+            }
+        }
+
+        /**
+         * Returns the decision for the \p reason of an object of the \p className in the
+         * \p application .
+         */
+        const ProfileDecision& decide(const QString &application, const QString &className, int reason) const
+        {
+            if(m_reasons.contains(reason)) {
+                QHash<ProfileKey, ProfileDecision>::ConstIterator it;
+                if((it = m_table.constFind(ProfileKey(application, qMakePair(className, reason)))) != m_table.constEnd()
+                   || (it = m_table.constFind(ProfileKey(application, qMakePair(QString(), reason)))) != m_table.constEnd()
+                   || (it = m_table.constFind(ProfileKey(QString(), qMakePair(className, reason)))) != m_table.constEnd()
+                   || (it = m_table.constFind(ProfileKey(QString(), qMakePair(QString(), reason)))) != m_table.constEnd())
+                    return it.value();
+            }
+            QHash<int, ProfileDecision>::ConstIterator it = m_defaults.constFind(reason);
+            return it != m_defaults.constEnd() ? it.value() : m_silent;
+        }
+
+    private:
+        void addRule(const QString &application, const QString &key, const QString &rule)
+        {
+            const int reason = reasonFromString(key.section(QLatin1Char(' '), 0, 0));
+            if(reason < 0) {
+                kWarning() << "Unknown reason in profile rule" << key;
+                return;
+            }
+            ProfileDecision decision;
+            const QString fields = rule.section(QLatin1Char(';'), 0, 0).trimmed().toLower();
+            const QString priority = rule.section(QLatin1Char(';'), 1).trimmed().toLower();
+            decision.m_priority = m_defaults.value(reason, decision).m_priority;
+            if(!priority.isEmpty()) {
+                static const char *priorities[] = { "important", "message", "text", "notification", "progress" };
+                for(int i = 0; i < 5; ++i)
+                    if(priority == QLatin1String( priorities[i] ))
+                        decision.m_priority = Speaker::Priority(Speaker::Important + i);
+            }
+            if(fields != QLatin1String( "none" )) {
+                static const char *names[] = { "name", "role", "value", "description", "accelerator" };
+                foreach(const QString &field, fields.split(QLatin1Char(','), QString::SkipEmptyParts)) {
+                    int i = 0;
+                    while(i < 5 && field.trimmed() != QLatin1String( names[i] ))
+                        ++i;
+                    if(i < 5)
+                        decision.m_fields.append(i);
+                    else
+                        kWarning() << "Unknown field in profile rule" << key << field;
+                }
+            }
+            decision.m_speak = !decision.m_fields.isEmpty();
+            m_table.insert(ProfileKey(application, qMakePair(key.section(QLatin1Char(' '), 1).trimmed(), reason)), decision);
+            m_reasons.insert(reason);
+        }
+
+        QHash<ProfileKey, ProfileDecision> m_table;
+        QSet<int> m_reasons;
+        QHash<int, ProfileDecision> m_defaults;
+        ProfileDecision m_silent;
+};
+
+/// Earcon files longer than that many milliseconds are cut.
+static const int s_maxEarconMsecs = 1000;
+
+/**
+ * Short sounds for state changes and the like that are faster to hear than their
+ * spoken name. The sounds are decoded once at startup from the WAV files named in the
+ * [Earcons] group of the config or else generated, and kept in memory as PCM.
+ */
+class EarconPlayer
+{
+    public:
+        enum Cue {
+            Checked = 0,
+            Unchecked,
+            MenuStart,
+            MenuEnd,
+            DialogStart,
+            Alert,
+            CueCount
+        };
+
+        explicit EarconPlayer() : m_sink(0) {}
+        ~EarconPlayer() { delete m_sink; }
+
+        /// Creates the sink of the \p kind and decodes the sounds.
+        void load(const QString &kind)
+        {
+            if(m_sink)
+                return;
+            m_sink = AudioSink::create(kind);
+            QMutexLocker locker(Settings::instance()->mutex());
+            KConfigGroup group = Settings::instance()->config()->group("Earcons");
+            for(int cue = 0; cue < CueCount; ++cue) {
+                const QString file = group.readPathEntry(cueName(cue), QString());
+                m_pcm[cue] = file.isEmpty() ? QByteArray() : decodeWav(file);
+                if(m_pcm[cue].isEmpty())
+                    m_pcm[cue] = generate(cue);
+            }
+        }
+
+        bool isLoaded() const { return m_sink; }
+
+        void play(int cue)
+        {
+            if(m_sink && cue >= 0 && cue < CueCount)
+                m_sink->play(m_pcm[cue]);
+        }
+
+        static const char* cueName(int cue)
+        {
+            static const char *names[] = { "Checked", "Unchecked", "MenuStart", "MenuEnd", "DialogStart", "Alert" };
+            return names[cue];
+        }
+
+        /// Returns the cue for the \p reason and the new \p state or -1 if there is none.
+        static int cue(int reason, int state)
+        {
+            switch(reason) {
+                case QAccessible::PopupMenuStart: return MenuStart;
+                case QAccessible::PopupMenuEnd: return MenuEnd;
+                case QAccessible::DialogStart: return DialogStart;
+                case QAccessible::Alert: return Alert;
+                case QAccessible::StateChanged: return (state & QAccessible::Checked) ? Checked : Unchecked;
+                default: return -1;
+            }
+        }
+
+    private:
+        /// Returns tones of \p msecs each with the \p frequencies one after the other.
+        static QByteArray tones(const QList<int> &frequencies, int msecs)
+        {
+            const int samples = s_audioSampleRate * msecs / 1000;
+            const int fade = s_audioSampleRate * 5 / 1000; // against clicks
+            QByteArray pcm(frequencies.count() * samples * 2, 0);
+            qint16 *out = reinterpret_cast<qint16*>(pcm.data());
+            foreach(int frequency, frequencies) {
+                for(int i = 0; i < samples; ++i) {
+                    const qreal envelope = qMin(qreal(1.0), qMin(qreal(i), qreal(samples - i)) / fade);
+                    const qreal sample = qSin(2 * M_PI * frequency * i / s_audioSampleRate) * envelope * 0.3;
+                    *out++ = qToLittleEndian(qint16(sample * 32767));
+                }
+            }
+            return pcm;
+        }
+
+        static QByteArray generate(int cue)
+        {
+            switch(cue) {
+                case Checked: return tones(QList<int>() << 660 << 880, 40);
+                case Unchecked: return tones(QList<int>() << 880 << 660, 40);
+                case MenuStart: return tones(QList<int>() << 1000, 40);
+                case MenuEnd: return tones(QList<int>() << 700, 40);
+                case DialogStart: return tones(QList<int>() << 523 << 659 << 784, 40);
+                case Alert: return tones(QList<int>() << 880 << 0 << 880, 60);
+            }
+            return QByteArray();
+        }
+
+        /**
+         * Returns the PCM of the 16 bit WAV \p file converted to the format of the
+         * earcons or an empty array if the file can't be read.
+         */
+        static QByteArray decodeWav(const QString &file)
+        {
+            QFile f(file);
+            if(!f.open(QIODevice::ReadOnly)) {
+                kWarning() << "Failed to open earcon" << file;
+                return QByteArray();
+            }
+            const QByteArray data = f.read(1024 * 1024);
+            if(data.size() < 12 || !data.startsWith("RIFF") || data.mid(8, 4) != "WAVE")
+                return QByteArray();
+            int channels = 0;
+            int rate = 0;
+            int bits = 0;
+            QByteArray samples;
+            for(int pos = 12; pos + 8 <= data.size();) {
+                const QByteArray id = data.mid(pos, 4);
+                const int size = qFromLittleEndian<quint32>(reinterpret_cast<const uchar*>(data.constData() + pos + 4));
+                const int start = pos + 8;
+                if(size < 0 || size > data.size() - start)
+                    break;
+                if(id == "fmt " && size >= 16) {
+                    const uchar *fmt = reinterpret_cast<const uchar*>(data.constData() + start);
+                    if(qFromLittleEndian<quint16>(fmt) != 1) // PCM
+                        return QByteArray();
+                    channels = qFromLittleEndian<quint16>(fmt + 2);
+                    rate = qFromLittleEndian<quint32>(fmt + 4);
+                    bits = qFromLittleEndian<quint16>(fmt + 14);
+                } else if(id == "data") {
+                    samples = data.mid(start, size);
+                }
+                const int next = start + size + (size & 1);
+                if(next <= pos)
+                    break;
+                pos = next;
+            }
+            if(channels < 1 || rate < 1 || bits != 16 || samples.isEmpty()) {
+                kWarning() << "Earcons need to be 16 bit PCM WAV files:" << file;
+                return QByteArray();
+            }
+
+            return convertPcm(samples, channels, rate, s_audioSampleRate * s_maxEarconMsecs / 1000);
+        }
+
+        AudioSink *m_sink;
+        QByteArray m_pcm[CueCount];
+};
+
+/// A dbus call forwarded to a bridge whose reply is passed back to the caller.
+class ForwardedCall
+{
+    public:
+        QDBusMessage m_request;
+        QString m_connectionName;
+};
+
+class Adaptor::Private
+{
+    public:
+        QDBusConnection m_connection;
+        bool m_speechEnabled;
+        QDBusServiceWatcher *m_watcher;
+        SourceTable m_sources;
+        QSet<QString> m_clients;
+        KAccessibleFocus m_currentFocus;
+        QContiguousCache<KAccessibleFocus> m_focusHistory;
+        QTimer *m_idleTimer;
+        QHash<int, Subscription*> m_subscriptions;
+        int m_lastSubscriptionId;
+
+        // Coalescing of the focusChanged signal, see Adaptor::emitFocusChanged.
+        int m_focusInterval;
+        bool m_focusPrediction;
+        QBasicTimer m_focusTimer;
+        bool m_focusPending;
+        bool m_focusSettle;
+        QPoint m_focusPoint;
+        QRect m_focusRect;
+        QRect m_emittedFocusRect;
+        QElapsedTimer m_emittedFocusTime;
+
+        InboundScheduler m_inbound;
+        bool m_inboundScheduled;
+
+        SpeechReader *m_reader;
+
+        // Merging and repeat suppression of what is said, see Adaptor::mergeFocus.
+        PendingUtterance m_utterance;
+        ProfileDecision m_utteranceDecision;
+        ProfileTable m_profiles;
+        QBasicTimer m_mergeTimer;
+        int m_mergeWindow;
+        int m_repeatWindow;
+        QElapsedTimer m_clock;
+        QList< QPair<QString, qint64> > m_recentUtterances; // text, time said, oldest first
+
+        VerbosityController m_verbosity;
+        int m_speechRate;
+
+        SpatialGrid m_grid;
+        int m_bridgeFeatures;
+        KAccessibleFilterList m_filters;
+
+        QHash<QDBusPendingCallWatcher*, ForwardedCall> m_forwarded;
+
+        // The window read by Adaptor::readAll .
+        QString m_focusService;
+        QString m_readService;
+        QDBusPendingCallWatcher *m_readStart;
+        int m_readSession;
+
+        int m_keyEchoMode; // 1 for characters, 2 for words
+
+        EarconPlayer m_earcons;
+        bool m_earconsEnabled;
+
+        explicit Private(const QDBusConnection &connection) : m_connection(connection), m_speechEnabled(false), m_watcher(0), m_sources(128), m_focusHistory(32), m_idleTimer(0), m_lastSubscriptionId(0), m_focusInterval(0), m_focusPrediction(false), m_focusPending(false), m_focusSettle(false), m_inboundScheduled(false), m_reader(0), m_mergeWindow(0), m_repeatWindow(0), m_speechRate(0), m_bridgeFeatures(0), m_readStart(0), m_readSession(0), m_keyEchoMode(0), m_earconsEnabled(true) {}
+
+        /**
+         * Returns the \p rect moved ahead by half a frame along the path the focus moved
+         * since it was emitted the last time. The rect is never moved further than it
+         * moved since then.
+         */
+        QRect predictFocusRect(const QRect &rect) const
+        {
+            if(!m_emittedFocusRect.isValid() || !m_emittedFocusTime.isValid())
+                return rect;
+            const qint64 elapsed = m_emittedFocusTime.elapsed();
+            if(elapsed <= 0 || elapsed > 2 * m_focusInterval)
+                return rect;
+            const QPoint moved = rect.center() - m_emittedFocusRect.center();
+            const qreal factor = qMin(qreal(1.0), qreal(m_focusInterval) / qreal(2 * elapsed));
+            return rect.translated(qRound(moved.x() * factor), qRound(moved.y() * factor));
+        }
+        /// Returns what the profiles decided about the \p reason for the \p iface .
+        const ProfileDecision& decide(int reason, const KAccessibleInterface &iface, const Source *source) const
+        {
+            return m_profiles.decide(source ? source->m_application : QString(), iface.className, reason);
+        }
+
+        ~Private() { qDeleteAll(m_subscriptions); }
+};
+
+Adaptor::Adaptor(const QDBusConnection &connection, QObject *parent)
+    : QObject(parent)
+    , d(new Private(connection))
+{
+    Settings *settings = Settings::instance();
+    d->m_speechEnabled = settings->value("SpeechEnabled", d->m_speechEnabled).toBool();
+
+    const int prevVoiceType = Speaker::instance()->voiceType();
+    const int newVoiceType = settings->value("VoiceType", prevVoiceType).toInt();
+    if(prevVoiceType != newVoiceType)
+        Speaker::instance()->setVoiceType(newVoiceType);
+    Speaker::instance()->setVoice(settings->value("Voice", QString()).toString());
+
+    d->m_watcher = new QDBusServiceWatcher(this);
+    d->m_watcher->setConnection(d->m_connection);
+    d->m_watcher->setWatchMode(QDBusServiceWatcher::WatchForUnregistration);
+    connect(d->m_watcher, SIGNAL(serviceUnregistered(QString)), this, SLOT(serviceUnregistered(QString)));
+
+    // An IdleTimeout of 0 seconds means we never exit on our own.
+    d->m_idleTimer = new QTimer(this);
+    d->m_idleTimer->setSingleShot(true);
+    d->m_idleTimer->setInterval(qMax(0, settings->value("IdleTimeout", 0).toInt()) * 1000);
+    connect(d->m_idleTimer, SIGNAL(timeout()), this, SLOT(idleTimeout()));
+    touch();
+
+    // The focusChanged signal is emitted at most FocusFrameRate times per second, 0 disables that.
+    const int frameRate = settings->value("FocusFrameRate", 60).toInt();
+    d->m_focusInterval = frameRate > 0 ? qMax(1, 1000 / frameRate) : 0;
+    d->m_focusPrediction = settings->value("FocusPrediction", d->m_focusPrediction).toBool();
+
+    // Name and value changes following the focus within MergeWindow milliseconds are said
+    // together with it and the same text is not repeated within RepeatWindow milliseconds.
+    d->m_mergeWindow = qMax(0, settings->value("MergeWindow", 100).toInt());
+    d->m_repeatWindow = qMax(0, settings->value("RepeatWindow", 500).toInt());
+    d->m_clock.start();
+    d->m_profiles.load();
+
+    // If the speech lags more than MaxSpeechLag milliseconds behind, 0 disables that,
+    // less is said and the SpeechRate is raised by RateBoost.
+    d->m_verbosity.m_maxLag = qMax(0, settings->value("MaxSpeechLag", 3000).toInt());
+    d->m_verbosity.m_rateBoost = settings->value("RateBoost", 40).toInt();
+    d->m_speechRate = settings->value("SpeechRate", 0).toInt();
+    Speaker::instance()->setRate(d->m_speechRate);
+    connect(Speaker::instance(), SIGNAL(finished(int)), this, SLOT(speechProgressed()));
+    connect(Speaker::instance(), SIGNAL(cancelled(int)), this, SLOT(speechProgressed()));
+
+    d->m_reader = new SpeechReader(this);
+    connect(d->m_reader, SIGNAL(positionChanged(int,int)), this, SIGNAL(readingPositionChanged(int,int)));
+    connect(d->m_reader, SIGNAL(needMore(int)), this, SLOT(fetchReading(int)));
+
+    // The bridges only send the positions of objects while someone asks for them.
+    if(settings->value("GeometryEvents", false).toBool())
+        d->m_bridgeFeatures |= KAccessibleGeometryEvents;
+    if(settings->value("TreeSync", false).toBool())
+        d->m_bridgeFeatures |= KAccessibleTreeSync;
+    d->m_keyEchoMode = settings->value("KeyEcho", 0).toInt() & 3;
+    if(d->m_keyEchoMode)
+        d->m_bridgeFeatures |= KAccessibleKeyEcho;
+    loadFilters();
+
+    // The earcons are decoded once here. AudioSink=null plays nothing, e.g. for testing.
+    d->m_earconsEnabled = settings->value("Earcons", d->m_earconsEnabled).toBool();
+    if(d->m_earconsEnabled)
+        d->m_earcons.load(settings->value("AudioSink", QString()).toString());
+
+    // Short phrases are synthesized in-process and cached in up to PhraseCacheKb kilobytes,
+    // in the Language the texts are normalised for too. Unless PhraseCache=always that is
+    // only done if speech-dispatcher speaks with eSpeak NG as well.
+    Speaker::instance()->setLanguage(settings->value("Language", QLocale::system().name()).toString());
+    Speaker::instance()->setPhraseCache(settings->value("PhraseCacheKb", 4096).toInt(), settings->value("AudioSink", QString()).toString(), settings->value("PhraseCache", QString()).toString() == QLatin1String( "always" ));
+    updateSpeechFeatures();
+    QTimer::singleShot(0, this, SLOT(announceBridgeFeatures()));
+
+    restoreState();
+
+    // Connect with speech-dispatcher once the event loop runs so the first text does not
+    // need to wait for it.
+    if(d->m_speechEnabled)
+        QTimer::singleShot(0, this, SLOT(warmUp()));
+}
+
+Adaptor::~Adaptor()
+{
+    saveState();
+    delete d;
+}
+
+QString Adaptor::source() const
+{
+    return calledFromDBus() ? message().service() : QString();
+}
+
+Source* Adaptor::sourceFor(const QString &service)
+{
+    if(service.isEmpty())
+        return 0;
+    if(Source *source = d->m_sources.find(service))
+        return source;
+
+    Source *source = new Source(service);
+    if(Source *evicted = d->m_sources.insert(source)) {
+        d->m_grid.removeSource(evicted->m_service);
+        if(!d->m_clients.contains(evicted->m_service))
+            d->m_watcher->removeWatchedService(evicted->m_service);
+        delete evicted;
+    }
+    watch(service);
+
+    // The process is resolved once per source without blocking the event.
+    QDBusPendingCall call = d->m_connection.interface()->asyncCall(QLatin1String( "GetConnectionUnixProcessID" ), service);
+    QDBusPendingCallWatcher *watcher = new QDBusPendingCallWatcher(call, this);
+    watcher->setProperty("service", service);
+    connect(watcher, SIGNAL(finished(QDBusPendingCallWatcher*)), this, SLOT(sourceProcessResolved(QDBusPendingCallWatcher*)));
+    return source;
+}
+
+void Adaptor::sourceProcessResolved(QDBusPendingCallWatcher *watcher)
+{
+    QDBusPendingReply<uint> reply = *watcher;
+    Source *source = d->m_sources.find(watcher->property("service").toString());
+    if(source && !reply.isError()) {
+        source->m_pid = reply.value();
+#if defined(Q_OS_LINUX)
+        QFile f(QString(QLatin1String( "/proc/%1/comm" )).arg(source->m_pid));
+        if(f.open(QIODevice::ReadOnly))
+            source->m_application = QString::fromLocal8Bit(f.readAll().trimmed());
+#endif
+    }
+    watcher->deleteLater();
+}
+
+QStringList Adaptor::sources() const
+{
+    QList<Source*> sources = d->m_sources.sources();
+    qSort(sources.begin(), sources.end(), sourceEventsGreaterThan);
+    QStringList result;
+    foreach(Source *source, sources)
+        result.append(QString(QLatin1String( "%1 pid=%2 service=%3 events=%4" )).arg(source->m_application).arg(source->m_pid).arg(source->m_service).arg(source->m_events));
+    return result;
+}
+
+void Adaptor::touch()
+{
+    if(d->m_idleTimer->interval() > 0)
+        d->m_idleTimer->start();
+}
+
+void Adaptor::watch(const QString &service)
+{
+    if(!service.isEmpty() && !d->m_watcher->watchedServices().contains(service))
+        d->m_watcher->addWatchedService(service);
+}
+
+void Adaptor::setRootObject(const KAccessibleInterface& iface)
+{
+    Q_UNUSED(iface);
+    touch();
+    if(Source *source = sourceFor(this->source()))
+        source->m_isBridge = true;
+}
+
+void Adaptor::registerClient()
+{
+    touch();
+    const QString service = source();
+    if(!service.isEmpty()) {
+        d->m_clients.insert(service);
+        watch(service);
+    }
+}
+
+void Adaptor::unregisterClient()
+{
+    touch();
+    d->m_clients.remove(source());
+}
+
+int Adaptor::subscribe(const QString& path, const QList<int>& reasons, int fields, int minInterval, const QString& application)
+{
+    touch();
+    const QString service = source();
+    if(service.isEmpty())
+        return -1;
+
+    Subscription *subscription = new Subscription;
+    subscription->m_id = ++d->m_lastSubscriptionId;
+    subscription->m_service = service;
+    subscription->m_path = path;
+    subscription->m_reasons = reasons.toSet();
+    subscription->m_fields = fields;
+    subscription->m_minInterval = minInterval;
+    subscription->m_application = application;
+    d->m_subscriptions.insert(subscription->m_id, subscription);
+    watch(service);
+    return subscription->m_id;
+}
+
+void Adaptor::unsubscribe(int id)
+{
+    touch();
+    Subscription *subscription = d->m_subscriptions.value(id);
+    if(subscription && subscription->m_service == source())
+        delete d->m_subscriptions.take(id);
+}
+
+void Adaptor::dispatch(int reason, const KAccessibleInterface& iface, Source *source)
+{
+    if(source)
+        source->count(reason);
+
+    emit notified(reason, iface);
+
+    if(d->m_subscriptions.isEmpty())
+        return;
+
+    KAccessibleEvent event;
+    event.reason = reason;
+    event.iface = iface;
+    event.source = source ? source->m_application : QString();
+    event.timestamp = QDateTime::currentMSecsSinceEpoch();
+    foreach(Subscription *subscription, d->m_subscriptions) {
+        if(!subscription->matches(reason, source))
+            continue;
+        subscription->add(event);
+        // The first event is delivered at once, the following ones once the interval passed.
+        if(subscription->m_minInterval <= 0) {
+            subscription->flush(d->m_connection);
+        } else if(!subscription->m_timer.isActive()) {
+            subscription->flush(d->m_connection);
+            subscription->m_timer.start(subscription->m_minInterval, this);
+        }
+    }
+}
+
+void Adaptor::emitFocusChanged(const QPoint &point, const QRect &rect)
+{
+    if(d->m_focusInterval <= 0) {
+        emit focusChanged(point.x(), point.y(), rect.x(), rect.y(), rect.width(), rect.height());
+        return;
+    }
+
+    // The first change is emitted at once. Changes within the following frame interval
+    // are coalesced and the latest one is emitted at the end of the interval.
+    d->m_focusPoint = point;
+    d->m_focusRect = rect;
+    d->m_focusPending = true;
+    if(!d->m_focusTimer.isActive()) {
+        flushFocusChanged(false);
+        d->m_focusTimer.start(d->m_focusInterval, this);
+    }
+}
+
+void Adaptor::flushFocusChanged(bool predict)
+{
+    const QRect r = predict && d->m_focusPrediction ? d->predictFocusRect(d->m_focusRect) : d->m_focusRect;
+    emit focusChanged(d->m_focusPoint.x(), d->m_focusPoint.y(), r.x(), r.y(), r.width(), r.height());
+    d->m_emittedFocusRect = r;
+    d->m_emittedFocusTime.start();
+    d->m_focusPending = false;
+    // A predicted rect is followed by the exact one at the end of the next interval.
+    d->m_focusSettle = r != d->m_focusRect;
+}
+
+void Adaptor::timerEvent(QTimerEvent *event)
+{
+    if(event->timerId() == d->m_mergeTimer.timerId()) {
+        flushUtterance();
+        return;
+    }
+    if(event->timerId() == d->m_focusTimer.timerId()) {
+        if(d->m_focusPending)
+            flushFocusChanged(true);
+        else if(d->m_focusSettle)
+            flushFocusChanged(false);
+        else
+            d->m_focusTimer.stop();
+        return;
+    }
+    foreach(Subscription *subscription, d->m_subscriptions) {
+        if(subscription->m_timer.timerId() == event->timerId()) {
+            if(subscription->m_pending.isEmpty())
+                subscription->m_timer.stop();
+            else
+                subscription->flush(d->m_connection);
+            return;
+        }
+    }
+    QObject::timerEvent(event);
+}
+
+void Adaptor::serviceUnregistered(const QString &service)
+{
+    d->m_sources.remove(service);
+    d->m_grid.removeSource(service);
+    d->m_clients.remove(service);
+    foreach(Subscription *subscription, d->m_subscriptions.values()) {
+        if(subscription->m_service == service)
+            delete d->m_subscriptions.take(subscription->m_id);
+    }
+    d->m_watcher->removeWatchedService(service);
+}
+
+void Adaptor::idleTimeout()
+{
+    // Bridges don't keep us alive since the dbus-daemon starts us again with their next
+    // message. Clients listening to our signals need to stay served.
+    if(!d->m_clients.isEmpty() || !d->m_subscriptions.isEmpty() || Speaker::instance()->isSpeaking()) {
+        touch();
+        return;
+    }
+    kDebug() << "Exit after being idle for" << d->m_idleTimer->interval() / 1000 << "seconds";
+    QMetaObject::invokeMethod(QCoreApplication::instance(), "quit", Qt::QueuedConnection);
+}
+
+int Adaptor::bridgeFeatures() const
+{
+    return d->m_bridgeFeatures;
+}
+
+void Adaptor::announceBridgeFeatures()
+{
+    // Bridges of applications that outlived a previous instance of us reset their features.
+    emit bridgeFeaturesChanged(d->m_bridgeFeatures);
+    emit bridgeFiltersChanged(d->m_filters);
+}
+
+KAccessibleFilterList Adaptor::bridgeFilters() const
+{
+    return d->m_filters;
+}
+
+void Adaptor::reloadFilters()
+{
+    touch();
+    loadFilters();
+    emit bridgeFiltersChanged(d->m_filters);
+}
+
+void Adaptor::loadFilters()
+{
+    d->m_filters.clear();
+    QMutexLocker locker(Settings::instance()->mutex());
+    KSharedConfig::Ptr config = Settings::instance()->config();
+    QStringList groups = config->groupList();
+    groups.sort();
+    const QString prefix = QLatin1String( "Filter " );
+    foreach(const QString &name, groups) {
+        if(!name.startsWith(prefix))
+            continue;
+        KConfigGroup group = config->group(name);
+        KAccessibleFilter filter;
+        filter.name = name.mid(prefix.length());
+        filter.className = group.readEntry("ClassName", QString());
+        filter.objectName = group.readEntry("ObjectName", QString());
+        // An empty condition matches everything, so a rule with a name that can't be
+        // parsed is dropped as a whole instead of matching more than was meant.
+        bool valid = true;
+        foreach(const QString &state, group.readEntry("State", QStringList())) {
+            if(state.trimmed().isEmpty())
+                continue;
+            const int flag = stateFromString(state.trimmed());
+            if(flag) {
+                filter.state |= flag;
+            } else {
+                kWarning() << "Unknown state in filter" << filter.name << state << ", the filter is ignored";
+                valid = false;
+            }
+        }
+        foreach(const QString &reason, group.readEntry("Reasons", QStringList())) {
+            if(reason.trimmed().isEmpty())
+                continue;
+            const int r = reasonFromString(reason.trimmed());
+            if(r >= 0) {
+                filter.reasons.append(r);
+            } else {
+                kWarning() << "Unknown reason in filter" << filter.name << reason << ", the filter is ignored";
+                valid = false;
+            }
+        }
+        if(valid && filter.className.isEmpty() && filter.objectName.isEmpty() && !filter.state && filter.reasons.isEmpty()) {
+            kWarning() << "The filter" << filter.name << "has no conditions and would drop all events, it is ignored";
+            valid = false;
+        }
+        if(valid)
+            d->m_filters.append(filter);
+    }
+}
+
+QList<qulonglong> Adaptor::filterHits(const QString& service)
+{
+    touch();
+    QDBusMessage call = QDBusMessage::createMethodCall(service, QLatin1String( "/KAccessibleBridge" ), QLatin1String( "org.kde.kaccessiblebridge" ), QLatin1String( "filterHits" ));
+    forward(service, call);
+    return QList<qulonglong>();
+}
+
+void Adaptor::enableBridgeFeature(int feature)
+{
+    if(d->m_bridgeFeatures & feature)
+        return;
+    d->m_bridgeFeatures |= feature;
+    emit bridgeFeaturesChanged(d->m_bridgeFeatures);
+}
+
+void Adaptor::setTreeChanged(bool reset, const KAccessibleNodeList& nodes, const KAccessibleHandleList& removed)
+{
+    Source *source = sourceFor(this->source());
+    if(!source)
+        return;
+    if(!source->m_tree)
+        source->m_tree = new TreeMirror;
+    if(reset)
+        source->m_tree->clear();
+    foreach(qulonglong handle, removed)
+        source->m_tree->remove(handle);
+    foreach(KAccessibleNode node, nodes) {
+        node.name = source->intern(node.name);
+        node.className = source->internClassName(node.className);
+        source->m_tree->update(node);
+    }
+}
+
+KAccessibleInterfaceList Adaptor::query(const QString& service, const KAccessibleHandleList& handles, int fields, int &cursor)
+{
+    touch();
+    cursor = 0;
+    QDBusMessage call = QDBusMessage::createMethodCall(service, QLatin1String( "/KAccessibleBridge" ), QLatin1String( "org.kde.kaccessiblebridge" ), QLatin1String( "query" ));
+    call << qVariantFromValue(handles) << fields;
+    forward(service, call);
+    return KAccessibleInterfaceList();
+}
+
+KAccessibleInterfaceList Adaptor::queryMore(const QString& service, int cursor, int &nextCursor)
+{
+    touch();
+    nextCursor = 0;
+    QDBusMessage call = QDBusMessage::createMethodCall(service, QLatin1String( "/KAccessibleBridge" ), QLatin1String( "org.kde.kaccessiblebridge" ), QLatin1String( "queryMore" ));
+    call << cursor;
+    forward(service, call);
+    return KAccessibleInterfaceList();
+}
+
+void Adaptor::forward(const QString& service, const QDBusMessage& call)
+{
+    if(!calledFromDBus())
+        return;
+    Source *source = d->m_sources.find(service);
+    if(!source || !source->m_isBridge) {
+        sendErrorReply(QDBusError::InvalidArgs, QLatin1String( "No bridge known for " ) + service);
+        return;
+    }
+
+    // The reply of the bridge is passed on as it is, without waiting for it here.
+    setDelayedReply(true);
+    ForwardedCall forwarded;
+    forwarded.m_request = message();
+    forwarded.m_connectionName = connection().name();
+    QDBusPendingCallWatcher *watcher = new QDBusPendingCallWatcher(d->m_connection.asyncCall(call), this);
+    d->m_forwarded.insert(watcher, forwarded);
+    connect(watcher, SIGNAL(finished(QDBusPendingCallWatcher*)), this, SLOT(forwardedCallFinished(QDBusPendingCallWatcher*)));
+}
+
+void Adaptor::forwardedCallFinished(QDBusPendingCallWatcher *watcher)
+{
+    const ForwardedCall forwarded = d->m_forwarded.take(watcher);
+    const QDBusMessage reply = watcher->reply();
+    QDBusConnection connection(forwarded.m_connectionName);
+    if(reply.type() == QDBusMessage::ErrorMessage)
+        connection.send(forwarded.m_request.createErrorReply(reply.errorName(), reply.errorMessage()));
+    else
+        connection.send(forwarded.m_request.createReply(reply.arguments()));
+    watcher->deleteLater();
+}
+
+KAccessibleNode Adaptor::treeNode(const QString& service, qulonglong handle)
+{
+    touch();
+    enableBridgeFeature(KAccessibleTreeSync);
+    KAccessibleNode node;
+    Source *source = d->m_sources.find(service);
+    if(source && source->m_tree)
+        source->m_tree->node(handle, node);
+    return node;
+}
+
+KAccessibleNodeList Adaptor::treeChildren(const QString& service, qulonglong handle)
+{
+    touch();
+    enableBridgeFeature(KAccessibleTreeSync);
+    Source *source = d->m_sources.find(service);
+    return source && source->m_tree ? source->m_tree->children(handle) : KAccessibleNodeList();
+}
+
+void Adaptor::setGeometryChanged(const KAccessibleObjectList& objects)
+{
+    const QString service = source();
+    if(service.isEmpty())
+        return;
+    sourceFor(service);
+    foreach(KAccessibleObject object, objects) {
+        object.source = service;
+        d->m_grid.update(object);
+    }
+}
+
+KAccessibleObject Adaptor::hitTest(int x, int y)
+{
+    touch();
+    enableBridgeFeature(KAccessibleGeometryEvents);
+    return d->m_grid.hitTest(QPoint(x, y));
+}
+
+KAccessibleObjectList Adaptor::objectsInRect(const QRect& rect)
+{
+    touch();
+    enableBridgeFeature(KAccessibleGeometryEvents);
+    return d->m_grid.objectsInRect(rect);
+}
+
+void Adaptor::warmUp()
+{
+    if(d->m_speechEnabled && !Speaker::instance()->isConnected())
+        Speaker::instance()->reconnect();
+    // Once connected it is known whether phrases are cached.
+    updateSpeechFeatures();
+}
+
+void Adaptor::saveState()
+{
+    QMutexLocker locker(Settings::instance()->mutex());
+    KConfigGroup group = Settings::instance()->config()->group("State");
+    group.deleteGroup();
+    QStringList bridges;
+    foreach(Source *source, d->m_sources.sources()) {
+        if(!source->m_isBridge)
+            continue;
+        bridges.append(source->m_service);
+        KConfigGroup sourceGroup = group.group(source->m_service);
+        sourceGroup.writeEntry("Pid", source->m_pid);
+        sourceGroup.writeEntry("Application", source->m_application);
+        // The other strings are names of the UI, e.g. document titles, that are not
+        // written to disk.
+        sourceGroup.writeEntry("ClassNames", QStringList(source->m_classNames.toList()));
+        if(source->m_lastFocus.timestamp > 0) {
+            sourceGroup.writeEntry("Name", source->m_lastFocus.iface.name);
+            sourceGroup.writeEntry("Rect", source->m_lastFocus.rect);
+            sourceGroup.writeEntry("ObjectName", source->m_lastFocus.iface.objectName);
+            sourceGroup.writeEntry("ClassName", source->m_lastFocus.iface.className);
+            sourceGroup.writeEntry("Timestamp", source->m_lastFocus.timestamp);
+        }
+    }
+    group.writeEntry("Bridges", bridges);
+}
+
+void Adaptor::restoreState()
+{
+    QMutexLocker locker(Settings::instance()->mutex());
+    KConfigGroup group = Settings::instance()->config()->group("State");
+    foreach(const QString &service, group.readEntry("Bridges", QStringList())) {
+        KConfigGroup sourceGroup = group.group(service);
+        Source *source = new Source(service);
+        source->m_isBridge = true;
+        source->m_pid = sourceGroup.readEntry("Pid", uint(0));
+        source->m_application = sourceGroup.readEntry("Application", service);
+        foreach(const QString &className, sourceGroup.readEntry("ClassNames", QStringList()))
+            source->internClassName(className);
+        source->m_lastFocus.timestamp = sourceGroup.readEntry("Timestamp", qint64(0));
+        if(source->m_lastFocus.timestamp > 0) {
+            KAccessibleFocus &focus = source->m_lastFocus;
+            focus.source = source->m_application;
+            focus.iface.name = sourceGroup.readEntry("Name", QString());
+            focus.iface.rect = focus.rect = sourceGroup.readEntry("Rect", QRect());
+            focus.iface.objectName = sourceGroup.readEntry("ObjectName", QString());
+            focus.iface.className = source->internClassName(sourceGroup.readEntry("ClassName", QString()));
+        }
+        delete d->m_sources.insert(source);
+
+        // The bridges may have gone while we were not running and their unique names
+        // may be owned by other processes now, e.g. after a new login. Ask without
+        // blocking and forget about them if so. The focus is only restored once the
+        // process is known to be the same.
+        watch(service);
+        QDBusPendingCall call = d->m_connection.interface()->asyncCall(QLatin1String( "GetConnectionUnixProcessID" ), service);
+        QDBusPendingCallWatcher *watcher = new QDBusPendingCallWatcher(call, this);
+        watcher->setProperty("service", service);
+        connect(watcher, SIGNAL(finished(QDBusPendingCallWatcher*)), this, SLOT(restoredServiceChecked(QDBusPendingCallWatcher*)));
+    }
+}
+
+void Adaptor::restoredServiceChecked(QDBusPendingCallWatcher *watcher)
+{
+    QDBusPendingReply<uint> reply = *watcher;
+    const QString service = watcher->property("service").toString();
+    watcher->deleteLater();
+    Source *source = d->m_sources.find(service);
+    if(!source)
+        return;
+    if(reply.isError()) {
+        // The name has no owner anymore.
+        serviceUnregistered(service);
+        return;
+    }
+    if(!source->m_pid || reply.value() != source->m_pid) {
+        // Another process owns the name now, it gets a fresh record with its next event.
+        d->m_sources.remove(service);
+        d->m_grid.removeSource(service);
+        return;
+    }
+    if(source->m_lastFocus.timestamp > d->m_currentFocus.timestamp)
+        d->m_currentFocus = source->m_lastFocus;
+}
+
+void Adaptor::enqueue(int reason, const KAccessibleInterface& iface)
+{
+    touch();
+    d->m_inbound.enqueue(InboundEvent(reason, iface, source()));
+
+    // The processing is done once all the messages that arrived meanwhile got queued.
+    if(!d->m_inboundScheduled) {
+        d->m_inboundScheduled = true;
+        QMetaObject::invokeMethod(this, "processInbound", Qt::QueuedConnection);
+    }
+}
+
+void Adaptor::processInbound()
+{
+    d->m_inboundScheduled = false;
+
+    // Value changes are processed in small slices so newly arrived focus changes and
+    // alerts don't wait for a long backlog.
+    int valueBudget = 16;
+    InboundEvent event;
+    while((valueBudget > 0 || d->m_inbound.hasUrgent()) && d->m_inbound.take(event)) {
+        switch(event.m_reason) {
+            case QAccessible::Focus:
+                processFocusChanged(event.m_iface, event.m_service);
+                break;
+            case QAccessible::Alert:
+                processAlert(event.m_iface, event.m_service);
+                break;
+            case QAccessible::NameChanged:
+                if(event.m_isSilent)
+                    dispatch(event.m_reason, event.m_iface, sourceFor(event.m_service));
+                else
+                    processNameChanged(event.m_iface, event.m_service);
+                --valueBudget;
+                break;
+            default:
+                if(event.m_isSilent)
+                    dispatch(QAccessible::ValueChanged, event.m_iface, sourceFor(event.m_service));
+                else
+                    processValueChanged(event.m_iface, event.m_service);
+                --valueBudget;
+                break;
+        }
+        event = InboundEvent();
+    }
+
+    if(!d->m_inbound.isEmpty() && !d->m_inboundScheduled) {
+        d->m_inboundScheduled = true;
+        QMetaObject::invokeMethod(this, "processInbound", Qt::QueuedConnection);
+    }
+}
+
+void Adaptor::setFocusChanged(const KAccessibleInterface& iface)
+{
+    enqueue(QAccessible::Focus, iface);
+}
+
+void Adaptor::setValueChanged(const KAccessibleInterface& iface)
+{
+    enqueue(QAccessible::ValueChanged, iface);
+}
+
+void Adaptor::setAlert(const KAccessibleInterface& iface)
+{
+    enqueue(QAccessible::Alert, iface);
+}
+
+void Adaptor::setNameChanged(const KAccessibleInterface& iface)
+{
+    enqueue(QAccessible::NameChanged, iface);
+}
+
+void Adaptor::setKeyEcho(const QString& character, const QString& word, qlonglong timestamp)
+{
+    // Called for each key press, so nothing is done here that is not needed for the echo.
+    if(!d->m_speechEnabled || !d->m_keyEchoMode)
+        return;
+    if(QDateTime::currentMSecsSinceEpoch() - timestamp > s_maxKeyEchoAge)
+        return;
+    // Single characters are passed on as they are, the normaliser would drop e.g. a "&".
+    if((d->m_keyEchoMode & 2) && !word.isEmpty())
+        Speaker::instance()->echo(TextNormalizer::instance()->utf8(word), timestamp);
+    else if((d->m_keyEchoMode & 1) && !character.trimmed().isEmpty())
+        Speaker::instance()->echo(character.toUtf8(), timestamp);
+}
+
+int Adaptor::keyEchoMode() const
+{
+    return d->m_keyEchoMode;
+}
+
+void Adaptor::setKeyEchoMode(int mode)
+{
+    mode &= 3;
+    if(d->m_keyEchoMode == mode)
+        return;
+    d->m_keyEchoMode = mode;
+    Settings::instance()->setValue("KeyEcho", mode);
+    if(mode) {
+        enableBridgeFeature(KAccessibleKeyEcho);
+    } else if(d->m_bridgeFeatures & KAccessibleKeyEcho) {
+        d->m_bridgeFeatures &= ~KAccessibleKeyEcho;
+        emit bridgeFeaturesChanged(d->m_bridgeFeatures);
+    }
+}
+
+int Adaptor::keyEchoLatency() const
+{
+    return Speaker::instance()->echoLatency();
+}
+
+void Adaptor::setPopupItems(const KAccessibleInterfaceList& items)
+{
+    touch();
+    if(!d->m_speechEnabled || !Speaker::instance()->hasPhraseCache())
+        return;
+    // Composed the same way as the focus is, else the cached phrases would not match.
+    const QString service = this->source();
+    Source *source = sourceFor(service);
+    QList<QByteArray> utf8s;
+    foreach(const KAccessibleInterface &item, items) {
+        const ProfileDecision &decision = d->decide(QAccessible::Focus, item, source);
+        if(decision.m_speak)
+            utf8s.append(TextNormalizer::instance()->utf8(decision.compose(item.name, item.role, item.value, item.description, item.accelerator, d->m_verbosity.m_level)));
+    }
+    Speaker::instance()->preparePhrases(utf8s);
+}
+
+QList<int> Adaptor::phraseCacheStatistics() const
+{
+    return Speaker::instance()->phraseCacheStatistics();
+}
+
+void Adaptor::processFocusChanged(const KAccessibleInterface& iface, const QString& service)
+{
+    Source *source = sourceFor(service);
+
+    KAccessibleFocus focus;
+    focus.rect = iface.rect;
+    focus.iface = iface;
+    focus.timestamp = QDateTime::currentMSecsSinceEpoch();
+    if(source) {
+        focus.source = source->m_application;
+        focus.iface.className = source->internClassName(iface.className);
+        source->m_lastFocus = focus;
+    }
+    d->m_currentFocus = focus;
+    d->m_focusHistory.append(focus);
+    d->m_focusService = service;
+
+    if(iface.handle && !iface.rect.isEmpty()) {
+        KAccessibleObject object;
+        object.source = service;
+        object.handle = iface.handle;
+        object.rect = iface.rect;
+        object.name = iface.name;
+        object.role = iface.role;
+        d->m_grid.update(object);
+    }
+
+    emitFocusChanged(focus.point, focus.rect);
+
+    dispatch(QAccessible::Focus, iface, source);
+
+    mergeFocus(iface, service, d->decide(QAccessible::Focus, iface, source));
+}
+
+void Adaptor::mergeFocus(const KAccessibleInterface& iface, const QString& service, const ProfileDecision& decision)
+{
+    flushUtterance();
+    d->m_utteranceDecision = decision;
+    d->m_utterance.m_service = service;
+    d->m_utterance.m_handle = iface.handle;
+    d->m_utterance.m_name = iface.name;
+    d->m_utterance.m_role = iface.role;
+    d->m_utterance.m_value = iface.value;
+    d->m_utterance.m_description = iface.description;
+    d->m_utterance.m_accelerator = iface.accelerator;
+    d->m_utterance.m_isPending = true;
+    if(d->m_mergeWindow > 0 && iface.handle)
+        d->m_mergeTimer.start(d->m_mergeWindow, this);
+    else
+        flushUtterance();
+}
+
+void Adaptor::flushUtterance()
+{
+    d->m_mergeTimer.stop();
+    if(!d->m_utterance.m_isPending)
+        return;
+    d->m_utterance.m_isPending = false;
+    if(!d->m_utteranceDecision.m_speak)
+        return;
+
+    // E.g. "Volume, slider, 40%". The more the speech lags behind the less is said.
+    updateVerbosity();
+    const PendingUtterance &u = d->m_utterance;
+    const QString text = d->m_utteranceDecision.compose(u.m_name, u.m_role, u.m_value, u.m_description, u.m_accelerator, d->m_verbosity.m_level);
+    sayUnlessRepeated(text, d->m_utteranceDecision.m_priority);
+}
+
+void Adaptor::updateVerbosity()
+{
+    Speaker *speaker = Speaker::instance();
+    if(d->m_verbosity.update(speaker->backlog(), speaker->averageDuration())) {
+        kDebug() << "Speech lags behind, rate boost" << d->m_verbosity.m_boosted;
+        speaker->setRate(d->m_speechRate + (d->m_verbosity.m_boosted ? d->m_verbosity.m_rateBoost : 0));
+    }
+}
+
+void Adaptor::speechProgressed()
+{
+    updateVerbosity();
+}
+
+void Adaptor::sayUnlessRepeated(const QString& text, int priority)
+{
+    if(text.isEmpty())
+        return;
+    if(d->m_repeatWindow > 0) {
+        const qint64 now = d->m_clock.elapsed();
+        while(!d->m_recentUtterances.isEmpty() && now - d->m_recentUtterances.first().second > d->m_repeatWindow)
+            d->m_recentUtterances.removeFirst();
+        for(int i = 0; i < d->m_recentUtterances.count(); ++i)
+            if(d->m_recentUtterances.at(i).first == text)
+                return;
+        d->m_recentUtterances.append(qMakePair(text, now));
+    }
+    sayText(text, priority);
+}
+
+KAccessibleFocus Adaptor::currentFocus() const
+{
+    return d->m_currentFocus;
+}
+
+KAccessibleFocusList Adaptor::focusHistory(int count) const
+{
+    KAccessibleFocusList result;
+    for(int i = d->m_focusHistory.lastIndex(); i >= d->m_focusHistory.firstIndex() && result.count() < count; --i)
+        result.append(d->m_focusHistory.at(i));
+    return result;
+}
+
+void Adaptor::processValueChanged(const KAccessibleInterface& iface, const QString& service)
+{
+    Source *source = sourceFor(service);
+    dispatch(QAccessible::ValueChanged, iface, source);
+    if(d->m_utterance.isFor(iface, service)) {
+        d->m_utterance.m_value = iface.value;
+        return;
+    }
+    say(QAccessible::ValueChanged, iface, source);
+}
+
+void Adaptor::processNameChanged(const KAccessibleInterface& iface, const QString& service)
+{
+    Source *source = sourceFor(service);
+    dispatch(QAccessible::NameChanged, iface, source);
+    if(d->m_utterance.isFor(iface, service)) {
+        d->m_utterance.m_name = iface.name;
+        return;
+    }
+    say(QAccessible::NameChanged, iface, source);
+}
 
-    setVoiceType(d->m_voiceType);
-    return true;
+void Adaptor::processAlert(const KAccessibleInterface& iface, const QString& service)
+{
+    Source *source = sourceFor(service);
+    dispatch(QAccessible::Alert, iface, source);
+    const ProfileDecision &decision = d->decide(QAccessible::Alert, iface, source);
+    if(!decision.m_speak)
+        return;
+    Speaker::instance()->cancel();
+    playCue(QAccessible::Alert, 0);
+    sayText(decision.compose(iface.name, iface.role, iface.value, iface.description, iface.accelerator, VerbosityController::Full), int(decision.m_priority));
 }
 
-bool Speaker::isSpeaking() const
+void Adaptor::setEventCue(int reason, int state)
 {
-    return d->m_isSpeaking;
+    playCue(reason, state);
 }
 
-void Speaker::setSpeaking(bool speaking)
+void Adaptor::playCue(int reason, int state)
 {
-    d->m_isSpeaking = speaking;
+    // Played right away, the sound system mixes it with the speech.
+    if(d->m_speechEnabled && d->m_earconsEnabled)
+        d->m_earcons.play(EarconPlayer::cue(reason, state));
 }
 
-void Speaker::cancel()
+void Adaptor::playEarcon(const QString& name)
 {
-    QMutexLocker locker(&d->m_mutex);
-    d->m_sayStack.clear();
-#if defined(SPEECHD_FOUND)
-    if(d->m_connection) {
-        spd_cancel_all(d->m_connection);
-    }
-#endif
+    touch();
+    for(int cue = 0; cue < EarconPlayer::CueCount; ++cue)
+        if(name == QLatin1String( EarconPlayer::cueName(cue) ))
+            d->m_earcons.play(cue);
 }
 
-bool Speaker::say(const QString& text, Priority priority)
+bool Adaptor::earconsEnabled() const
 {
-    QMutexLocker locker(&d->m_mutex);
-    if(!isConnected())
-        return false;
-    d->m_sayStack.push( QPair<QString,Speaker::Priority>(text,priority) );
-    if(!d->m_isSpeaking)
-        QTimer::singleShot(0, this, SLOT(sayNext()));
-    return true;
+    return d->m_earconsEnabled;
 }
 
-void Speaker::sayNext()
+void Adaptor::setEarconsEnabled(bool enabled)
 {
-    QMutexLocker locker(&d->m_mutex);
-    if(d->m_sayStack.isEmpty()) {
+    if(d->m_earconsEnabled == enabled)
         return;
-    }
-    QPair<QString,Speaker::Priority> p = d->m_sayStack.pop();
-#if defined(SPEECHD_FOUND)
-    if(d->m_connection) {
-        SPDPriority spdpriority = (SPDPriority) p.second;
-        int msg_id  = spd_say(d->m_connection, spdpriority, p.first.toUtf8().data());
-        if(msg_id == -1) {
-            kWarning() << "Failed to say text=" << p.first;
-        }
-    }
-#else
-    //QDBusInterface iface("org.kde.jovie","/KSpeech");
-    //iface.asyncCall("say", text, 0);
-#endif
+    d->m_earconsEnabled = enabled;
+    Settings::instance()->setValue("Earcons", enabled);
+    if(enabled)
+        d->m_earcons.load(Settings::instance()->value("AudioSink", QString()).toString());
+    updateSpeechFeatures();
 }
 
-char** Speaker::modules() const
+void Adaptor::updateSpeechFeatures()
 {
-#if defined(SPEECHD_FOUND)
-    if(d->m_connection)
-        return spd_list_modules(d->m_connection);
-#endif
-    return NULL;
+    // The bridges only send the events that are cued while the cues are heard and the
+    // items of popup menus while phrases are cached.
+    int features = d->m_bridgeFeatures & ~(KAccessibleEarcons | KAccessiblePopupItems);
+    if(d->m_speechEnabled && d->m_earconsEnabled)
+        features |= KAccessibleEarcons;
+    if(d->m_speechEnabled && Speaker::instance()->hasPhraseCache())
+        features |= KAccessiblePopupItems;
+    if(features == d->m_bridgeFeatures)
+        return;
+    d->m_bridgeFeatures = features;
+    emit bridgeFeaturesChanged(d->m_bridgeFeatures);
 }
 
-char** Speaker::voices() const
+void Adaptor::say(int reason, const KAccessibleInterface& iface, Source *source)
 {
-#if defined(SPEECHD_FOUND)
-    if(d->m_connection)
-        return spd_list_voices(d->m_connection);
-#endif
-    return NULL;
+    const ProfileDecision &decision = d->decide(reason, iface, source);
+    if(!decision.m_speak)
+        return;
+    // The focus is said first, what happens elsewhere must not be heard before it.
+    flushUtterance();
+    updateVerbosity();
+    sayUnlessRepeated(decision.compose(iface.name, iface.role, iface.value, iface.description, iface.accelerator, d->m_verbosity.m_level), int(decision.m_priority));
 }
 
-QStringList Speaker::languages() const
+void Adaptor::reloadProfiles()
 {
-    QStringList result;
-#if defined(SPEECHD_FOUND)
-    if(d->m_connection) {
-        SPDVoice** voices = spd_list_synthesis_voices(d->m_connection);
-        while(voices && voices[0]) {
-            const QString lng = QString::fromLatin1(voices[0]->language);
-            if(!lng.isEmpty() && !result.contains(lng)) result.append(lng);
-            ++voices;
+    touch();
+    d->m_profiles.load();
+}
+
+void Adaptor::sayText(const QString& text, int priority)
+{
+    touch();
+    if(d->m_speechEnabled && !text.isEmpty() && (Speaker::instance()->isConnected() || Speaker::instance()->reconnect())) {
+        if(text.length() > s_maxInlineNormalizeLength) {
+            QFutureWatcher<QByteArray> *watcher = new QFutureWatcher<QByteArray>(this);
+            watcher->setProperty("priority", priority);
+            connect(watcher, SIGNAL(finished()), this, SLOT(textNormalized()));
+            watcher->setFuture(QtConcurrent::run(TextNormalizer::instance(), &TextNormalizer::utf8, text));
+        } else {
+            Speaker::instance()->sayUtf8(TextNormalizer::instance()->utf8(text), Speaker::Priority(priority));
         }
     }
-#endif
-    return result;
 }
 
-int Speaker::voiceType() const
+void Adaptor::textNormalized()
 {
-    return d->m_voiceType;
+    QFutureWatcher<QByteArray> *watcher = static_cast<QFutureWatcher<QByteArray>*>(sender());
+    const QByteArray utf8 = watcher->result();
+    if(d->m_speechEnabled && !utf8.isEmpty())
+        Speaker::instance()->sayUtf8(utf8, Speaker::Priority(watcher->property("priority").toInt()));
+    watcher->deleteLater();
 }
 
-void Speaker::setVoiceType(int type)
+void Adaptor::readText(const QString& text)
 {
-    d->m_voiceType = type;
-#if defined(SPEECHD_FOUND)
-    if(d->m_connection) {
-        spd_set_voice_type_all(d->m_connection, (SPDVoiceType) type);
-    }
-#endif
+    touch();
+    d->m_readStart = 0;
+    d->m_readSession = 0;
+    if(text.isEmpty())
+        d->m_reader->stop();
+    else
+        d->m_reader->read(text);
 }
 
-void Speaker::clearSayStack()
+void Adaptor::pauseReading()
 {
-    d->m_sayStack.clear();
+    touch();
+    d->m_reader->pause();
 }
 
-class Adaptor::Private
+void Adaptor::resumeReading()
 {
-    public:
-        bool m_speechEnabled;
-        explicit Private() : m_speechEnabled(false) {}
-};
+    touch();
+    d->m_reader->resume();
+}
 
-Adaptor::Adaptor(QObject *parent)
-    : QObject(parent)
-    , d(new Private)
+void Adaptor::skipReading(int sentences)
 {
-    KConfig config(QLatin1String( "kaccessibleapp" ));
-    KConfigGroup group = config.group("Main");
-    d->m_speechEnabled = group.readEntry("SpeechEnabled", d->m_speechEnabled);
-
-    const int prevVoiceType = Speaker::instance()->voiceType();
-    const int newVoiceType = group.readEntry("VoiceType", prevVoiceType);
-    if(prevVoiceType != newVoiceType)
-        Speaker::instance()->setVoiceType(newVoiceType);
+    touch();
+    d->m_reader->skip(sentences);
 }
 
-Adaptor::~Adaptor()
+void Adaptor::stopReading()
 {
-    delete d;
+    touch();
+    d->m_readStart = 0;
+    d->m_readSession = 0;
+    d->m_reader->stop();
 }
 
-void Adaptor::setFocusChanged(const KAccessibleInterface& iface)
+void Adaptor::readAll()
 {
-    int px = -1;
-    int py = -1;
-    QRect r = iface.rect;
-    emit focusChanged(px, py, r.x(), r.y(), r.width(), r.height());
+    touch();
+    d->m_reader->stop();
+    d->m_readSession = 0;
+    d->m_readStart = 0;
+    Source *source = d->m_sources.find(d->m_focusService);
+    if(!source || !source->m_isBridge)
+        return;
 
-    emit notified(QAccessible::Focus, iface);
+    // The bridge starts the walk at its active window and returns the session it is known by.
+    d->m_readService = d->m_focusService;
+    QDBusMessage call = QDBusMessage::createMethodCall(d->m_readService, QLatin1String( "/KAccessibleBridge" ), QLatin1String( "org.kde.kaccessiblebridge" ), QLatin1String( "readAll" ));
+    d->m_readStart = new QDBusPendingCallWatcher(d->m_connection.asyncCall(call), this);
+    connect(d->m_readStart, SIGNAL(finished(QDBusPendingCallWatcher*)), this, SLOT(readAllStarted(QDBusPendingCallWatcher*)));
+}
 
-    QString text = iface.name;
-    /*
-    if(!iface.accelerator.isEmpty()) {
-        QString s = iface.accelerator;
-        s = s.replace("+"," ");
-        text += " " + s;
+void Adaptor::readAllStarted(QDBusPendingCallWatcher *watcher)
+{
+    watcher->deleteLater();
+    if(watcher != d->m_readStart)
+        return;
+    d->m_readStart = 0;
+    QDBusPendingReply<int> reply = *watcher;
+    if(reply.isError() || !reply.value()) {
+        kDebug() << "Failed to read all of" << d->m_readService << reply.error().message();
+        return;
     }
-    */
-    sayText(text);
+    d->m_readSession = reply.value();
+    d->m_reader->readStream();
 }
 
-void Adaptor::setValueChanged(const KAccessibleInterface& iface)
+void Adaptor::fetchReading(int count)
 {
-    sayText(iface.value);
+    if(!d->m_readSession)
+        return;
+    QDBusMessage call = QDBusMessage::createMethodCall(d->m_readService, QLatin1String( "/KAccessibleBridge" ), QLatin1String( "org.kde.kaccessiblebridge" ), QLatin1String( "readMore" ));
+    call << d->m_readSession << count;
+    QDBusPendingCallWatcher *watcher = new QDBusPendingCallWatcher(d->m_connection.asyncCall(call), this);
+    watcher->setProperty("session", d->m_readSession);
+    connect(watcher, SIGNAL(finished(QDBusPendingCallWatcher*)), this, SLOT(readingFetched(QDBusPendingCallWatcher*)));
 }
 
-void Adaptor::setAlert(const KAccessibleInterface& iface)
+void Adaptor::readingFetched(QDBusPendingCallWatcher *watcher)
 {
-    Speaker::instance()->cancel();
-    sayText(iface.name, int(Speaker::Message));
+    watcher->deleteLater();
+    // Replies to a reading stopped or started again meanwhile are dropped.
+    if(!d->m_readSession || watcher->property("session").toInt() != d->m_readSession)
+        return;
+    QDBusPendingReply<KAccessibleInterfaceList, bool> reply = *watcher;
+    if(reply.isError()) {
+        kDebug() << "Failed to read more of" << d->m_readService << reply.error().message();
+        d->m_readSession = 0;
+        d->m_reader->appendSentences(QList<QByteArray>(), true);
+        return;
+    }
+
+    // Every object is one sentence, e.g. "Name, line edit, John".
+    const KAccessibleInterfaceList objects = reply.argumentAt<0>();
+    const bool finished = reply.argumentAt<1>();
+    QList<QByteArray> sentences;
+    foreach(const KAccessibleInterface &iface, objects) {
+        QStringList parts;
+        parts << iface.name << spokenRole(iface.role);
+        if(iface.value != iface.name)
+            parts << iface.value;
+        parts.removeAll(QString());
+        sentences.append(TextNormalizer::instance()->utf8(parts.join(QLatin1String( ", " ))));
+    }
+    if(finished)
+        d->m_readSession = 0;
+    d->m_reader->appendSentences(sentences, finished);
 }
 
-void Adaptor::sayText(const QString& text, int priority)
+int Adaptor::readingPosition() const
 {
-    if(d->m_speechEnabled && !text.isEmpty() && (Speaker::instance()->isConnected() || Speaker::instance()->reconnect())) {
-        Speaker::instance()->say(text, Speaker::Priority(priority));
-    }
+    return d->m_reader->position();
 }
 
 bool Adaptor::speechEnabled() const
@@ -356,18 +3965,40 @@ void Adaptor::setSpeechEnabled(bool enabled)
         return;
 
     d->m_speechEnabled = enabled;
-
-    KConfig config(QLatin1String( "kaccessibleapp" ));
-    KConfigGroup group = config.group("Main");
-    group.writeEntry("SpeechEnabled", d->m_speechEnabled);
+    Settings::instance()->setValue("SpeechEnabled", d->m_speechEnabled);
 
     if(!d->m_speechEnabled) {
         Speaker::instance()->cancel();
     }
+    updateSpeechFeatures();
 
     emit speechEnabledChanged(d->m_speechEnabled);
 }
 
+KAccessibleVoiceList Adaptor::voices() const
+{
+    return Speaker::instance()->voices();
+}
+
+QStringList Adaptor::languages() const
+{
+    return Speaker::instance()->languages();
+}
+
+QString Adaptor::voice() const
+{
+    return Speaker::instance()->voice();
+}
+
+void Adaptor::setVoice(const QString &name)
+{
+    if(name == Speaker::instance()->voice())
+        return;
+
+    Settings::instance()->setValue("Voice", name);
+    Speaker::instance()->setVoice(name);
+}
+
 int Adaptor::voiceType() const
 {
     return Speaker::instance()->voiceType();
@@ -378,94 +4009,86 @@ void Adaptor::setVoiceType(int type)
     if(type == Speaker::instance()->voiceType())
         return;
 
-    KConfig config(QLatin1String( "kaccessibleapp" ));
-    KConfigGroup group = config.group("Main");
-    group.writeEntry("VoiceType", type);
-
+    Settings::instance()->setValue("VoiceType", type);
     Speaker::instance()->setVoiceType(type);
 }
 
-class KAccessibleApp::Private
+class AdaptorThread::Private
 {
     public:
         Adaptor *m_adaptor;
-        QMap<QString, KAction*> m_collection;
-        explicit Private() : m_adaptor(0) {}
-        ~Private() { qDeleteAll(m_collection); }
+        bool m_started;
+        QMutex m_mutex;
+        QWaitCondition m_condition;
+        explicit Private() : m_adaptor(0), m_started(false) {}
 };
 
-KAccessibleApp::KAccessibleApp()
-    : KUniqueApplication()
+AdaptorThread::AdaptorThread(QObject *parent)
+    : QThread(parent)
     , d(new Private)
 {
-    qDBusRegisterMetaType<KAccessibleInterface>();
-
-    setWindowIcon(KIcon(QLatin1String( "preferences-desktop-accessibility" )));
-    setQuitOnLastWindowClosed(false);
-
-    d->m_adaptor = new Adaptor(this);
-    if( ! QDBusConnection::sessionBus().registerObject(QLatin1String( "/Adaptor" ), d->m_adaptor, QDBusConnection::ExportAllContents)) {
-        kWarning() << "Unable to register KAccessibleApp to dbus";
-        QTimer::singleShot(0, this, SLOT(quit()));
-    } else {
-        KToggleAction* enableScreenreaderAction = new KToggleAction(this);
-        enableScreenreaderAction->setText(i18n("Enable Screenreader"));
-        enableScreenreaderAction->setIcon(KIcon(QLatin1String( "text-speak" )));
-        enableScreenreaderAction->setChecked(d->m_adaptor->speechEnabled());
-        connect(enableScreenreaderAction, SIGNAL(triggered(bool)), this, SLOT(enableScreenreader(bool)));
-        connect(d->m_adaptor, SIGNAL(speechEnabledChanged(bool)), enableScreenreaderAction, SLOT(setChecked(bool)));
-        d->m_collection.insert(QLatin1String( "enableScreenreader" ), enableScreenreaderAction);
-
-        KAction* speakTextAction = new KAction(this);
-        speakTextAction->setText(i18n("Speak Text..."));
-        speakTextAction->setIcon(KIcon(QLatin1String( "text-plain" )));
-        connect(speakTextAction, SIGNAL(triggered(bool)), this, SLOT(speakText()));
-        d->m_collection.insert(QLatin1String( "speakText" ), speakTextAction);
-
-        KAction* speakClipboardAction = new KAction(this);
-        speakClipboardAction->setText(i18n("Speak Clipboard"));
-        speakClipboardAction->setIcon(KIcon(QLatin1String( "klipper" )));
-        connect(speakClipboardAction, SIGNAL(triggered(bool)), this, SLOT(speakClipboard()));
-        d->m_collection.insert(QLatin1String( "speakClipboard" ), speakClipboardAction);
-    }
 }
 
-KAccessibleApp::~KAccessibleApp()
+AdaptorThread::~AdaptorThread()
 {
+    quit();
+    wait();
     delete d;
 }
 
-Adaptor* KAccessibleApp::adaptor() const
+Adaptor* AdaptorThread::adaptor() const
 {
     return d->m_adaptor;
 }
 
-KAction* KAccessibleApp::action(const QString &name) const
+bool AdaptorThread::startAndWait()
 {
-    return d->m_collection.contains(name) ? d->m_collection[name] : 0;
+    QMutexLocker locker(&d->m_mutex);
+    start();
+    while(!d->m_started)
+        d->m_condition.wait(&d->m_mutex);
+    return d->m_adaptor;
 }
 
-void KAccessibleApp::enableScreenreader(bool enabled)
+void AdaptorThread::run()
 {
-    d->m_adaptor->setSpeechEnabled(enabled);
-}
+    const QString connectionName = QLatin1String( "kaccessibleapp-adaptor" );
+    const QString serviceName = QLatin1String( "org.kde.kaccessibleapp" );
+    {
+        QDBusConnection connection = QDBusConnection::connectToBus(QDBusConnection::SessionBus, connectionName);
 
-void KAccessibleApp::speakClipboard()
-{
-    const QString text = clipboard()->text();
-    if(!text.isEmpty()) {
-        //Speaker::instance()->cancel();
-        Speaker::instance()->say(text);
-    }
-}
+        // The Speaker is created in this thread so its slots are called here too. The
+        // Settings move on to a thread of their own.
+        Settings::instance();
+        Speaker::instance();
+        Adaptor adaptor(connection);
 
-void KAccessibleApp::speakText()
-{
-    const QString text = KInputDialog::getText(i18n("Speak Text"), i18n("Type the text and press OK to speak the text."));
-    if(!text.isEmpty()) {
-        //Speaker::instance()->cancel();
-        Speaker::instance()->say(text);
+        // The KUniqueApplication interface is exported on this connection too since it
+        // takes over the service name, see KAccessibleApp::KAccessibleApp.
+        bool ok = connection.isConnected()
+               && connection.registerObject(QLatin1String( "/Adaptor" ), &adaptor, QDBusConnection::ExportAllContents)
+               && connection.registerObject(QLatin1String( "/MainApplication" ), QCoreApplication::instance(), QDBusConnection::ExportAdaptors);
+        if(ok) {
+            QDBusReply<QDBusConnectionInterface::RegisterServiceReply> reply = connection.interface()->registerService(serviceName, QDBusConnectionInterface::QueueService, QDBusConnectionInterface::DontAllowReplacement);
+            ok = reply.isValid() && reply.value() != QDBusConnectionInterface::ServiceNotRegistered;
+        }
+
+        {
+            QMutexLocker locker(&d->m_mutex);
+            d->m_adaptor = ok ? &adaptor : 0;
+            d->m_started = true;
+            d->m_condition.wakeAll();
+        }
+
+        if(ok)
+            exec();
+
+        QMutexLocker locker(&d->m_mutex);
+        d->m_adaptor = 0;
     }
+    // The last changes are written by the settings thread, see Settings::Settings .
+    QMetaObject::invokeMethod(Settings::instance(), "sync", Qt::BlockingQueuedConnection);
+    QDBusConnection::disconnectFromBus(connectionName);
 }
 
 /// class for the icon shown in the systemtray.
@@ -483,7 +4106,7 @@ class SystemTray : public KSystemTrayIcon
             //QAction* fileQuitAction = actionCollection()->action("file_quit");
             //if(fileQuitAction) delete actionCollection()->takeAction(fileQuitAction);
 
-            foreach(const QString &name, QStringList() << QLatin1String( "enableScreenreader" ) << QLatin1String( "speakText" ) << QLatin1String( "speakClipboard" ))
+            foreach(const QString &name, QStringList() << QLatin1String( "enableScreenreader" ) << QLatin1String( "speakText" ) << QLatin1String( "speakClipboard" ) << QLatin1String( "configure" ))
                 if(KAction* action = app->action(name))
                     contextMenu()->addAction(action);
 
@@ -507,20 +4130,172 @@ class SystemTray : public KSystemTrayIcon
          }
 };
 
+class KAccessibleApp::Private
+{
+    public:
+        AdaptorThread *m_thread;
+        Adaptor *m_adaptor;
+        QMap<QString, KAction*> m_collection;
+        SystemTray *m_systemtray;
+        QPointer<MainWindow> m_mainWindow;
+        explicit Private() : m_thread(0), m_adaptor(0), m_systemtray(0) {}
+        ~Private() { delete m_mainWindow; delete m_systemtray; qDeleteAll(m_collection); delete m_thread; }
+};
+
+KAccessibleApp::KAccessibleApp()
+    : KUniqueApplication()
+    , d(new Private)
+{
+    qDBusRegisterMetaType<KAccessibleInterface>();
+    qDBusRegisterMetaType<KAccessibleInterfaceList>();
+    qDBusRegisterMetaType<KAccessibleFocus>();
+    qDBusRegisterMetaType<KAccessibleFocusList>();
+    qDBusRegisterMetaType<KAccessibleEvent>();
+    qDBusRegisterMetaType<KAccessibleEventList>();
+    qDBusRegisterMetaType<KAccessibleVoice>();
+    qDBusRegisterMetaType<KAccessibleVoiceList>();
+    qDBusRegisterMetaType<KAccessibleObject>();
+    qDBusRegisterMetaType<KAccessibleObjectList>();
+    qDBusRegisterMetaType<KAccessibleNode>();
+    qDBusRegisterMetaType<KAccessibleNodeList>();
+    qDBusRegisterMetaType<KAccessibleHandleList>();
+    qDBusRegisterMetaType<KAccessibleFilter>();
+    qDBusRegisterMetaType<KAccessibleFilterList>();
+
+    setQuitOnLastWindowClosed(false);
+
+    // The daemon core is set up and published first so the bridges are served as soon as
+    // possible. The user interface is created once the event loop runs, see createUserInterface.
+    //
+    // The Adaptor and the Speaker live in their own thread with an own dbus connection so
+    // events are never delayed by the user interface. That connection is queued for our
+    // service name which we then release here. Calls that still arrive on this connection
+    // meanwhile are passed on to the Adaptor's thread. Its signals are only exported on
+    // the Adaptor's own connection.
+    d->m_thread = new AdaptorThread;
+    if( ! d->m_thread->startAndWait()) {
+        kWarning() << "Unable to register KAccessibleApp to dbus";
+        QTimer::singleShot(0, this, SLOT(quit()));
+        return;
+    }
+    d->m_adaptor = d->m_thread->adaptor();
+    QDBusConnection::sessionBus().registerObject(QLatin1String( "/Adaptor" ), d->m_adaptor, QDBusConnection::ExportAllSlots);
+    QDBusConnection::sessionBus().interface()->unregisterService(QLatin1String( "org.kde.kaccessibleapp" ));
+
+    if( ! KCmdLineArgs::parsedArgs()->isSet("headless")) {
+        QTimer::singleShot(0, this, SLOT(createUserInterface()));
+    }
+}
+
+KAccessibleApp::~KAccessibleApp()
+{
+    delete d;
+}
+
+Adaptor* KAccessibleApp::adaptor() const
+{
+    return d->m_adaptor;
+}
+
+KAction* KAccessibleApp::action(const QString &name) const
+{
+    return d->m_collection.contains(name) ? d->m_collection[name] : 0;
+}
+
+void KAccessibleApp::createUserInterface()
+{
+    if(d->m_systemtray)
+        return;
+
+    setWindowIcon(KIcon(QLatin1String( "preferences-desktop-accessibility" )));
+
+    KToggleAction* enableScreenreaderAction = new KToggleAction(this);
+    enableScreenreaderAction->setText(i18n("Enable Screenreader"));
+    enableScreenreaderAction->setIcon(KIcon(QLatin1String( "text-speak" )));
+    // The adaptor lives in a thread of its own, its state is read from the settings.
+    enableScreenreaderAction->setChecked(Settings::instance()->value("SpeechEnabled", false).toBool());
+    connect(enableScreenreaderAction, SIGNAL(triggered(bool)), this, SLOT(enableScreenreader(bool)));
+    connect(d->m_adaptor, SIGNAL(speechEnabledChanged(bool)), enableScreenreaderAction, SLOT(setChecked(bool)));
+    d->m_collection.insert(QLatin1String( "enableScreenreader" ), enableScreenreaderAction);
+
+    KAction* speakTextAction = new KAction(this);
+    speakTextAction->setText(i18n("Speak Text..."));
+    speakTextAction->setIcon(KIcon(QLatin1String( "text-plain" )));
+    connect(speakTextAction, SIGNAL(triggered(bool)), this, SLOT(speakText()));
+    d->m_collection.insert(QLatin1String( "speakText" ), speakTextAction);
+
+    KAction* speakClipboardAction = new KAction(this);
+    speakClipboardAction->setText(i18n("Speak Clipboard"));
+    speakClipboardAction->setIcon(KIcon(QLatin1String( "klipper" )));
+    connect(speakClipboardAction, SIGNAL(triggered(bool)), this, SLOT(speakClipboard()));
+    d->m_collection.insert(QLatin1String( "speakClipboard" ), speakClipboardAction);
+
+    KAction* configureAction = new KAction(this);
+    configureAction->setText(i18n("Configure..."));
+    configureAction->setIcon(KIcon(QLatin1String( "configure" )));
+    connect(configureAction, SIGNAL(triggered(bool)), this, SLOT(showMainWindow()));
+    d->m_collection.insert(QLatin1String( "configure" ), configureAction);
+
+    d->m_systemtray = new SystemTray(this, 0);
+    connect(d->m_systemtray, SIGNAL(activated(QSystemTrayIcon::ActivationReason)), this, SLOT(systemTrayActivated(QSystemTrayIcon::ActivationReason)));
+    d->m_systemtray->show();
+}
+
+void KAccessibleApp::showMainWindow()
+{
+    // The settings window is only created on demand since it's not needed to serve the bridges.
+    if(!d->m_mainWindow)
+        d->m_mainWindow = new MainWindow(this);
+    d->m_mainWindow->show();
+    d->m_mainWindow->raise();
+}
+
+void KAccessibleApp::systemTrayActivated(QSystemTrayIcon::ActivationReason reason)
+{
+    if(reason == QSystemTrayIcon::Trigger) {
+        if(d->m_mainWindow && d->m_mainWindow->isVisible())
+            d->m_mainWindow->hide();
+        else
+            showMainWindow();
+    }
+}
+
+void KAccessibleApp::enableScreenreader(bool enabled)
+{
+    QMetaObject::invokeMethod(d->m_adaptor, "setSpeechEnabled", Qt::QueuedConnection, Q_ARG(bool, enabled));
+}
+
+void KAccessibleApp::speakClipboard()
+{
+    const QString text = clipboard()->text();
+    if(!text.isEmpty()) {
+        QMetaObject::invokeMethod(d->m_adaptor, "readText", Qt::QueuedConnection, Q_ARG(QString, text));
+    }
+}
+
+void KAccessibleApp::speakText()
+{
+    const QString text = KInputDialog::getText(i18n("Speak Text"), i18n("Type the text and press OK to speak the text."));
+    if(!text.isEmpty()) {
+        QMetaObject::invokeMethod(d->m_adaptor, "readText", Qt::QueuedConnection, Q_ARG(QString, text));
+    }
+}
+
 class MainWindow::Private
 {
     public:
         KAccessibleApp *m_app;
         Adaptor *m_adaptor;
-        SystemTray *m_systemtray;
         KPageWidget *m_pageTab;
         KPageWidgetModel *m_pageModel;
         KComboBox* m_voiceTypeCombo;
+        QCheckBox *m_enableReader;
+        QCheckBox *m_enableLogs;
         QTreeWidget *m_logs;
         bool m_hideMainWin;
         bool m_logEnabled;
 
-        explicit Private(KAccessibleApp *app) : m_app(app), m_adaptor(app->adaptor()), m_systemtray(0), m_pageTab(0), m_pageModel(0), m_voiceTypeCombo(0), m_logs(0), m_hideMainWin(false), m_logEnabled(false) {}
+        explicit Private(KAccessibleApp *app) : m_app(app), m_adaptor(app->adaptor()), m_pageTab(0), m_pageModel(0), m_voiceTypeCombo(0), m_enableReader(0), m_enableLogs(0), m_logs(0), m_hideMainWin(false), m_logEnabled(false) {}
 
         void addPage(QWidget* page, const QIcon& iconset, const QString& label)
         {
@@ -543,17 +4318,7 @@ MainWindow::MainWindow(KAccessibleApp *app)
     : KMainWindow()
     , d(new Private(app))
 {
-    KConfig config(QLatin1String( "kaccessibleapp" ));
-    KConfigGroup group = config.group("Main");
-    d->m_logEnabled = group.readEntry("LogEnabled", d->m_logEnabled);
-
-    const int prevVoiceType = Speaker::instance()->voiceType();
-    const int newVoiceType = group.readEntry("VoiceType", prevVoiceType);
-    if(prevVoiceType != newVoiceType)
-        Speaker::instance()->setVoiceType(newVoiceType);
-
-    d->m_systemtray = new SystemTray(app, this);
-    d->m_systemtray->show();
+    d->m_logEnabled = Settings::instance()->value("LogEnabled", d->m_logEnabled).toBool();
 
     d->m_pageTab = new KPageWidget(this);
     d->m_pageTab->setFaceType( KPageView::Tabbed ); //Auto,Plain,List,Tree,Tabbed
@@ -567,10 +4332,10 @@ MainWindow::MainWindow(KAccessibleApp *app)
     readerLayout->setMargin(0);
     readerPage->setLayout(readerLayout);
     QCheckBox *enableReader = new QCheckBox(i18n("Enable Screenreader"));
+    d->m_enableReader = enableReader;
     readerLayout->addWidget(enableReader,0,0,1,2);
 #if defined(SPEECHD_FOUND)
-    enableReader->setChecked(d->m_adaptor->speechEnabled());
-    connect(d->m_adaptor, SIGNAL(speechEnabledChanged(bool)), enableReader, SLOT(setChecked(bool)));
+    enableReader->setChecked(Settings::instance()->value("SpeechEnabled", false).toBool());
     connect(enableReader, SIGNAL(stateChanged(int)), this, SLOT(enableReaderChanged(int)));
 
     QLabel *voiceTypeLabel = new QLabel(i18n("Voice Type:"), readerPage);
@@ -585,8 +4350,9 @@ MainWindow::MainWindow(KAccessibleApp *app)
     d->m_voiceTypeCombo->addItem(i18n("Female 3"), SPD_FEMALE3);
     d->m_voiceTypeCombo->addItem(i18n("Boy"), SPD_CHILD_MALE);
     d->m_voiceTypeCombo->addItem(i18n("Girl"), SPD_CHILD_FEMALE);
+    const int voiceType = Settings::instance()->value("VoiceType", int(SPD_MALE1)).toInt();
     for(int i = 0; i < d->m_voiceTypeCombo->count(); ++i)
-        if(d->m_voiceTypeCombo->itemData(i).toInt() == Speaker::instance()->voiceType())
+        if(d->m_voiceTypeCombo->itemData(i).toInt() == voiceType)
             d->m_voiceTypeCombo->setCurrentIndex(i);
     connect(d->m_voiceTypeCombo, SIGNAL(activated(int)), this, SLOT(voiceTypeChanged(int)));
     readerLayout->addWidget(d->m_voiceTypeCombo,1,1);
@@ -604,6 +4370,7 @@ MainWindow::MainWindow(KAccessibleApp *app)
     logsLayout->setMargin(0);
     logsPage->setLayout(logsLayout);
     QCheckBox *enableLogsCheckbox = new QCheckBox(i18n("Enable Logs"));
+    d->m_enableLogs = enableLogsCheckbox;
     logsLayout->addWidget(enableLogsCheckbox);
     d->m_logs = new QTreeWidget(logsPage);
     d->m_logs->setColumnCount(10);
@@ -618,6 +4385,9 @@ MainWindow::MainWindow(KAccessibleApp *app)
     logsLayout->addWidget(d->m_logs);
     d->addPage(logsPage, KIcon(QLatin1String( "view-list-text" )), i18n("Logs"));
 
+    // Changes done elsewhere, e.g. over dbus or by another window, are shown here.
+    connect(Settings::instance(), SIGNAL(changed(QStringList)), this, SLOT(settingsChanged(QStringList)));
+
     setCentralWidget(d->m_pageTab);
     resize(QSize(460, 320).expandedTo(minimumSizeHint()));
     setAutoSaveSettings();
@@ -659,6 +4429,7 @@ void MainWindow::notified(int reason, const KAccessibleInterface& iface)
     if(root->childCount() > 1000) delete root->takeChild(0);
 
     QTreeWidgetItem *child = new QTreeWidgetItem(root);
+    child->setText(0, reasonToString(reason));
     child->setText(1, iface.className);
     child->setText(2, iface.name);
     child->setText(3, iface.value);
@@ -684,20 +4455,34 @@ void MainWindow::enableLogs(int state)
 
     if(d->m_logEnabled != logEnabled) {
         d->m_logEnabled = logEnabled;
-        KConfig config(QLatin1String( "kaccessibleapp" ));
-        KConfigGroup group = config.group("Main");
-        group.writeEntry("LogEnabled", d->m_logEnabled);
+        Settings::instance()->setValue("LogEnabled", d->m_logEnabled);
     }
 }
 
 void MainWindow::enableReaderChanged(int state)
 {
-    d->m_adaptor->setSpeechEnabled(state == Qt::Checked);
+    QMetaObject::invokeMethod(d->m_adaptor, "setSpeechEnabled", Qt::QueuedConnection, Q_ARG(bool, state == Qt::Checked));
 }
 
 void MainWindow::voiceTypeChanged(int index)
 {
-    d->m_adaptor->setVoiceType(d->m_voiceTypeCombo->itemData(index).toInt());
+    QMetaObject::invokeMethod(d->m_adaptor, "setVoiceType", Qt::QueuedConnection, Q_ARG(int, d->m_voiceTypeCombo->itemData(index).toInt()));
+}
+
+void MainWindow::settingsChanged(const QStringList& keys)
+{
+    Settings *settings = Settings::instance();
+    if(keys.contains(QLatin1String( "LogEnabled" )))
+        d->m_enableLogs->setChecked(settings->value("LogEnabled", false).toBool());
+#if defined(SPEECHD_FOUND)
+    if(keys.contains(QLatin1String( "SpeechEnabled" )))
+        d->m_enableReader->setChecked(settings->value("SpeechEnabled", false).toBool());
+    if(keys.contains(QLatin1String( "VoiceType" ))) {
+        const int index = d->m_voiceTypeCombo->findData(settings->value("VoiceType", int(SPD_MALE1)).toInt());
+        if(index >= 0)
+            d->m_voiceTypeCombo->setCurrentIndex(index);
+    }
+#endif
 }
 
 int main(int argc, char *argv[])
@@ -708,6 +4493,9 @@ int main(int argc, char *argv[])
                          ki18n("(c) 2010, 2011 Sebastian Sauer"));
     aboutData.addAuthor(ki18n("Sebastian Sauer"), ki18n("Maintainer"), "sebastian.sauer@kdab.com");
     KCmdLineArgs::init(argc, argv, &aboutData);
+    KCmdLineOptions options;
+    options.add("headless", ki18n("Run without system tray icon and settings window"));
+    KCmdLineArgs::addCmdLineOptions(options);
     KUniqueApplication::addCmdLineOptions();
     if (!KUniqueApplication::start()) {
        fprintf(stderr, "kaccessibleapp is already running!\n");
@@ -715,9 +4503,5 @@ int main(int argc, char *argv[])
     }
 
     KAccessibleApp app;
-
-    MainWindow window(&app);
-    //window.show();
-
     return app.exec();
 }
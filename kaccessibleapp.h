@@ -20,11 +20,20 @@
 #define KACCESSIBLEAPP_H
 
 #include <QDBusAbstractAdaptor>
+#include <QDBusContext>
+#include <QDBusConnection>
+#include <QThread>
+#include <QMutex>
 #include <QDebug>
+#include <QSystemTrayIcon>
 #include <KAction>
+#include <KSharedConfig>
 #include <KMainWindow>
 #include <KUniqueApplication>
 
+class KAccessibleVoice;
+typedef QList<KAccessibleVoice> KAccessibleVoiceList;
+
 /**
  * Highlevel text-to-speech interface.
  */
@@ -53,34 +62,276 @@ class Speaker : public QObject
 
         bool say(const QString& text, Priority priority = Text);
 
-        char** modules() const;
-        char** voices() const;
+        /**
+         * Same as \a say but with the text already converted to UTF-8, the encoding
+         * speech-dispatcher expects.
+         */
+        bool sayUtf8(const QByteArray& utf8, Priority priority = Text);
+
+        /**
+         * Adds the \p utf8 text to the end of the queue. Other than with \a say texts that
+         * are said meanwhile are spoken first. Returns the id of the utterance that is
+         * passed to the \a finished or \a cancelled signal or 0 if not connected.
+         */
+        int append(const QByteArray& utf8, Priority priority = Text);
+
+        /**
+         * Removes the utterances with the \p ids from the queue and stops speaking if
+         * one of them is spoken right now.
+         */
+        void remove(const QList<int>& ids);
+
+        /**
+         * Speaks the echo of a typed key or word right away, bypassing the queue of
+         * \a say and \a append . The echo interrupts what is said and cancels the echo
+         * of the previous key if that is still spoken. The \p timestamp is the time
+         * in milliseconds since the epoch the key was pressed.
+         */
+        bool echo(const QByteArray& utf8, qlonglong timestamp);
+
+        /**
+         * Returns the average and the largest time in milliseconds from the key press
+         * to the start of its echo or 0 if nothing was echoed yet.
+         */
+        int echoLatency() const;
+        int maxEchoLatency() const;
+
+        /**
+         * Returns the number of utterances waiting to be spoken including the one that
+         * is spoken right now.
+         */
+        int backlog() const;
+
+        /**
+         * Returns the average time in milliseconds it took to speak an utterance or 0
+         * if nothing was spoken yet.
+         */
+        int averageDuration() const;
+
+        /**
+         * The speech rate from -100, the slowest, to 100, the fastest. 0 is the default
+         * rate of speech-dispatcher.
+         */
+        int rate() const;
+        void setRate(int rate);
+
+        /**
+         * The catalogue of the output modules, voices and languages of speech-dispatcher.
+         * The catalogue is fetched in the background once connected and cached. The
+         * \a catalogueChanged signal is emitted once it is available.
+         */
+        QStringList modules() const;
+        KAccessibleVoiceList voices() const;
+        KAccessibleVoiceList voices(const QString &language, const QString &variant = QString()) const;
         QStringList languages() const;
-        
+
+        QString voice() const;
+        bool setVoice(const QString &name);
+
         int voiceType() const;
         void setVoiceType(int type);
 
+        /**
+         * The language texts are spoken in, e.g. "de". It is passed to speech-dispatcher
+         * and used for the phrases synthesized in-process.
+         */
+        QString language() const;
+        void setLanguage(const QString &language);
+
+        /**
+         * Keeps the PCM of up to \p maxKb kilobytes of short phrases that are synthesized
+         * in-process and plays them through the audio \p sink , see AudioSink, instead of
+         * passing them to speech-dispatcher. Phrases are synthesized after they were
+         * said once or in advance with \a preparePhrases . 0 disables the cache, it is
+         * also disabled if kaccessibleapp was built without eSpeak NG. Unless
+         * \p anyModule is true the cache is only used while speech-dispatcher speaks with
+         * its espeak module, so a phrase sounds the same whether it is cached or not.
+         */
+        void setPhraseCache(int maxKb, const QString &sink, bool anyModule);
+        bool hasPhraseCache() const;
+
+        /**
+         * Synthesizes the \p utf8 texts in the background if they are not cached yet,
+         * e.g. the items of a menu that was just opened.
+         */
+        void preparePhrases(const QList<QByteArray>& utf8s);
+
+        /**
+         * Returns the number of cache hits, misses, cached phrases and their size in kilobytes.
+         */
+        QList<int> phraseCacheStatistics() const;
+
         explicit Speaker();
         ~Speaker();
+    Q_SIGNALS:
+        void catalogueChanged();
+
+        /**
+         * Emitted once the utterance with the \p id was spoken or got cancelled.
+         */
+        void finished(int id);
+        void cancelled(int id);
     private slots:
         void sayNext();
-        void clearSayStack();
+        void utteranceStarted(int messageId, qlonglong time);
+        void utteranceEnded(int messageId, bool cancelled);
+        void echoStarted(int messageId, qlonglong time);
+        void echoEnded(int messageId);
+        void catalogueFetched();
+        void phraseFinished();
+    private:
+        void stopPhrase();
+        void interruptPhrase(Priority priority);
+        class Private;
+        Private *const d;
+};
+
+/**
+ * The settings of the kaccessibleapp. They are loaded once and kept in memory. Changes
+ * are written to disk after a short delay or at shutdown in a thread of their own.
+ */
+class Settings : public QObject
+{
+        Q_OBJECT
+    public:
+        static Settings* instance();
+
+        /**
+         * Returns the value of the \p key in the Main group. This can be called from
+         * any thread.
+         */
+        QVariant value(const char *key, const QVariant &defaultValue) const;
+
+        /**
+         * Sets the value of the \p key in the Main group. This can be called from any
+         * thread. Changes done within one event loop iteration are broadcasted with one
+         * \a changed signal.
+         */
+        void setValue(const char *key, const QVariant &value);
+
+        /**
+         * Returns the config for direct access to other groups than the Main group.
+         * The \a mutex needs to be locked while doing so. Only changes to the Main
+         * and the State group are written to disk.
+         */
+        KSharedConfig::Ptr config() const;
+        QMutex* mutex() const;
+
+        explicit Settings();
+        ~Settings();
+    public Q_SLOTS:
+
+        /**
+         * Writes pending changes to disk now.
+         */
+        void sync();
+    Q_SIGNALS:
+        void changed(const QStringList &keys);
+    private Q_SLOTS:
+        void scheduleSync();
+    private:
+        class Private;
+        Private *const d;
+};
+
+/**
+ * Reads a long text sentence by sentence. The text is split into sentences in a
+ * worker thread and only a few sentences at a time are passed to the \a Speaker .
+ * Pausing, resuming and skipping only touches those few sentences, no matter how
+ * long the text is. If the speech gets interrupted, e.g. by an alert, the reading
+ * pauses at the interrupted sentence.
+ */
+class SpeechReader : public QObject
+{
+        Q_OBJECT
+    public:
+        explicit SpeechReader(QObject *parent = 0);
+        virtual ~SpeechReader();
+
+        /**
+         * Starts to read the \p text . A text that is read right now is stopped.
+         */
+        void read(const QString &text);
+
+        /**
+         * Starts to read sentences that arrive over time, see \a appendSentences . The
+         * \a needMore signal asks for them a few seconds of speech ahead.
+         */
+        void readStream();
+
+        /**
+         * Appends the UTF-8 \p sentences to the stream. If \p last is true no more
+         * sentences follow.
+         */
+        void appendSentences(const QList<QByteArray> &sentences, bool last);
+
+        void pause();
+        void resume();
+
+        /**
+         * Moves the reading position by \p sentences forward or, if negative, backward.
+         */
+        void skip(int sentences);
+
+        void stop();
+
+        bool isReading() const;
+        bool isPaused() const;
+
+        /**
+         * Returns the index of the sentence that is read or -1 if nothing is read.
+         */
+        int position() const;
+
+        /**
+         * Returns the number of sentences of the text or -1 while it is not split yet.
+         */
+        int count() const;
+    Q_SIGNALS:
+        void positionChanged(int position, int count);
+        void finished();
+
+        /**
+         * Emitted while streaming if \p count more sentences should be appended.
+         */
+        void needMore(int count);
+    private Q_SLOTS:
+        void segmented();
+        void utteranceFinished(int id);
+        void utteranceCancelled(int id);
     private:
+        void feed();
+        void drop();
+        void requestMore();
         class Private;
         Private *const d;
 };
 
 class KAccessibleInterface;
+typedef QList<KAccessibleInterface> KAccessibleInterfaceList;
+class KAccessibleFocus;
+class Source;
+class ProfileDecision;
+typedef QList<KAccessibleFocus> KAccessibleFocusList;
+class KAccessibleObject;
+typedef QList<KAccessibleObject> KAccessibleObjectList;
+class KAccessibleNode;
+typedef QList<KAccessibleNode> KAccessibleNodeList;
+class KAccessibleFilter;
+typedef QList<KAccessibleFilter> KAccessibleFilterList;
+typedef QList<qulonglong> KAccessibleHandleList;
+class QDBusPendingCallWatcher;
+class QDBusMessage;
 
 /**
  * The Adaptor class provides a dbus interface for the KAccessibleApp .
  */
-class Adaptor : public QObject
+class Adaptor : public QObject, protected QDBusContext
 {
         Q_OBJECT
         Q_CLASSINFO("D-Bus Interface", "org.kde.kaccessibleapp.Adaptor")
     public:
-        explicit Adaptor(QObject *parent = 0);
+        explicit Adaptor(const QDBusConnection &connection, QObject *parent = 0);
         virtual ~Adaptor();
 
     Q_SIGNALS:
@@ -109,16 +360,98 @@ class Adaptor : public QObject
          */
         void notified(int reason, const KAccessibleInterface& iface);
 
+        /**
+         * This signal is emitted if the text passed to \a readText moved on to the
+         * sentence at \p position of \p count sentences.
+         */
+        void readingPositionChanged(int position, int count);
+
+        /**
+         * This signal is emitted if the KAccessibleFeature flags the bridges should
+         * follow changed, see \a bridgeFeatures .
+         */
+        void bridgeFeaturesChanged(int features);
+
+        /**
+         * This signal is emitted if the filter rules the bridges drop events with
+         * changed, see \a bridgeFilters .
+         */
+        void bridgeFiltersChanged(const KAccessibleFilterList& filters);
+
     public Q_SLOTS:
 
 //void notify(int reason, const KAccessibleInterface& iface);
 
+        /**
+         * This method is called by a bridge once it got loaded into an application. The
+         * bridge is then tracked till the application quits.
+         */
+        void setRootObject(const KAccessibleInterface& iface);
+
+        /**
+         * Client-applications that listen to our signals call this method to keep us
+         * running. Without any registered client we exit after the IdleTimeout configured
+         * in the Main group of the kaccessibleapp config. The registration ends with a call
+         * to \a unregisterClient or once the client disconnects from the bus.
+         */
+        void registerClient();
+
+        /**
+         * Ends a registration done with \a registerClient .
+         */
+        void unregisterClient();
+
         /**
          * This method is called if the focus changed.
          * The method emits the \a focusChanged signal above.
+         *
+         * This and the other methods called by the bridges queue the event. The
+         * queued events are processed by importance, see InboundScheduler.
          */
         void setFocusChanged(const KAccessibleInterface& iface);
 
+        /**
+         * Subscribes the calling client to events. Other than with the broadcasted
+         * \a focusChanged and \a notified signals only the matching events are send
+         * to the client by calling the notify(KAccessibleEventList) method of the
+         * org.kde.kaccessibleapp.Client interface at the object \p path of the client.
+         *
+         * \param reasons the QAccessible::Event reasons to deliver or all if empty.
+         * \param fields the KAccessibleInterface::Field mask of the fields to deliver.
+         * \param minInterval if larger than 0 events are delivered at most once per
+         * that many milliseconds as batch. A newer Focus event replaces an older one
+         * that was not delivered yet.
+         * \param application only deliver events of that application or all if empty.
+         * \return the id of the subscription that can be passed to \a unsubscribe .
+         *
+         * The subscription ends when the client disconnects from the bus. While a
+         * subscription exists we don't exit on idle, see \a registerClient .
+         */
+        int subscribe(const QString& path, const QList<int>& reasons, int fields, int minInterval, const QString& application);
+
+        /**
+         * Ends a subscription done with \a subscribe .
+         */
+        void unsubscribe(int id);
+
+        /**
+         * Returns the applications that send us events, the one with the most events
+         * first. Each line contains the application name, the process id, the dbus
+         * service name and the number of events.
+         */
+        QStringList sources() const;
+
+        /**
+         * Returns the last known focus or a focus with a timestamp of 0 if there was
+         * no focus change yet. Clients that start late use this to initialize.
+         */
+        KAccessibleFocus currentFocus() const;
+
+        /**
+         * Returns up to \p count of the last known focus changes, the most recent first.
+         */
+        KAccessibleFocusList focusHistory(int count) const;
+
         /**
          * This method is called if a value changed.
          */
@@ -129,11 +462,184 @@ class Adaptor : public QObject
          */
         void setAlert(const KAccessibleInterface& iface);
 
+        /**
+         * Returns the KAccessibleFeature flags the bridges should follow. Bridges fetch
+         * them once loaded and then follow the \a bridgeFeaturesChanged signal.
+         */
+        int bridgeFeatures() const;
+
+        /**
+         * Returns the filter rules the bridges drop events with. They are read from the
+         * [Filter <name>] groups of the config. Bridges fetch them once loaded and then
+         * follow the \a bridgeFiltersChanged signal.
+         */
+        KAccessibleFilterList bridgeFilters() const;
+
+        /**
+         * Reads the filter rules of the config again and passes them to the bridges.
+         */
+        void reloadFilters();
+
+        /**
+         * Returns how many events the application with the dbus \p service dropped per
+         * filter rule, in the order of \a bridgeFilters . The counts are asked from
+         * the application.
+         */
+        QList<qulonglong> filterHits(const QString& service);
+
+        /**
+         * This method is called by a bridge with the objects that got shown, moved, hidden
+         * or destroyed while the KAccessibleGeometryEvents feature is enabled.
+         */
+        void setGeometryChanged(const KAccessibleObjectList& objects);
+
+        /**
+         * Returns the smallest known object at the position \p x , \p y in screen
+         * coordinates or an object with a handle of 0 if there is none. The answer is
+         * given from the positions the bridges reported, no application is asked. The
+         * first call enables the KAccessibleGeometryEvents feature of the bridges, till
+         * then only the positions of focused objects are known.
+         */
+        KAccessibleObject hitTest(int x, int y);
+
+        /**
+         * Returns the known objects that intersect the \p rect , see \a hitTest .
+         */
+        KAccessibleObjectList objectsInRect(const QRect& rect);
+
+        /**
+         * This method is called by a bridge with the \p nodes of its accessible tree that
+         * got added or changed and the handles of the nodes that got \p removed while the
+         * KAccessibleTreeSync feature is enabled. If \p reset is true a new snapshot starts
+         * and the nodes known so far are dropped.
+         */
+        void setTreeChanged(bool reset, const KAccessibleNodeList& nodes, const KAccessibleHandleList& removed);
+
+        /**
+         * Returns the node with the \p handle of the application with the dbus \p service
+         * or a node with a handle of 0 if unknown. The answer is given from the mirror of
+         * the accessible tree, no application is asked. The first call enables the
+         * KAccessibleTreeSync feature of the bridges, till then the mirror is empty.
+         */
+        KAccessibleNode treeNode(const QString& service, qulonglong handle);
+
+        /**
+         * Returns the children of the node with the \p handle or the root if the handle
+         * is 0, see \a treeNode .
+         */
+        KAccessibleNodeList treeChildren(const QString& service, qulonglong handle);
+
+        /**
+         * Returns the KAccessibleInterface of the objects with the \p handles of the
+         * application with the dbus \p service in one round trip. Only the \p fields of
+         * the KAccessibleInterface::Field mask are filled. The result is in the order of
+         * the handles, unknown objects have a handle of 0. Large results are returned in
+         * pages, if there are more the \p cursor is not 0 and can be passed to
+         * \a queryMore to get the next page.
+         */
+        KAccessibleInterfaceList query(const QString& service, const KAccessibleHandleList& handles, int fields, int &cursor);
+
+        /**
+         * Returns the next page of a \a query .
+         */
+        KAccessibleInterfaceList queryMore(const QString& service, int cursor, int &nextCursor);
+
+        /**
+         * This method is called if the name of the focused object changed.
+         */
+        void setNameChanged(const KAccessibleInterface& iface);
+
+        /**
+         * Reads the profiles of the config again. They decide per application, class
+         * name and reason what is said, see the README.
+         */
+        void reloadProfiles();
+
+        /**
+         * This method is called by the bridges if a key got typed into a focused text
+         * field. The \p character is the typed text and \p word the word the character
+         * completed, if any. The echo is spoken right away, without going through the
+         * queue of the other events, and dropped if it is outdated already.
+         */
+        void setKeyEcho(const QString& character, const QString& word, qlonglong timestamp);
+
+        /**
+         * This method is called by the bridges for events that are heard as earcon, e.g.
+         * PopupMenuStart or a StateChanged of the focused object to the new \p state .
+         * The earcon is played right away, without waiting for the speech.
+         */
+        void setEventCue(int reason, int state);
+
+        /**
+         * Plays the earcon with the \p name , e.g. "Checked" or "MenuStart".
+         */
+        void playEarcon(const QString& name);
+
+        /**
+         * Returns true if state changes, menus, dialogs and alerts are cued with short
+         * sounds while the screenreader is enabled.
+         */
+        bool earconsEnabled() const;
+        void setEarconsEnabled(bool enabled);
+
+        /**
+         * What is echoed while typing, a combination of 1 for characters and 2 for
+         * words. 0, the default, disables the echo.
+         */
+        int keyEchoMode() const;
+        void setKeyEchoMode(int mode);
+
+        /**
+         * Returns the average time in milliseconds from a key press to the start of its
+         * echo.
+         */
+        int keyEchoLatency() const;
+
+        /**
+         * This method is called by the bridges with the \p items of a popup menu that was
+         * just opened. What would be said about them is synthesized in advance so it is
+         * heard right away once they get the focus.
+         */
+        void setPopupItems(const KAccessibleInterfaceList& items);
+
+        /**
+         * Returns the hits, the misses, the number and the kilobytes of the phrases cached
+         * by the in-process synthesis, see the PhraseCacheKb setting.
+         */
+        QList<int> phraseCacheStatistics() const;
+
         /**
          * This method can be called to use the text-to-speech interface to say something.
+         * The text is normalised first, e.g. accelerator markers are removed and known
+         * abbreviations expanded.
          */
         void sayText(const QString& text, int priority = 3);
 
+        /**
+         * Reads the \p text sentence by sentence. Other than \a sayText this is meant
+         * for long texts, the reading can be paused, resumed and moved around with
+         * the methods below. The text is read even if speech is disabled.
+         */
+        void readText(const QString& text);
+        void pauseReading();
+        void resumeReading();
+        void skipReading(int sentences);
+        void stopReading();
+
+        /**
+         * Reads the window that has the focus from top to bottom. The application walks
+         * its objects while they are read, a few seconds of speech ahead, so reading
+         * starts right away even in windows with huge views. The reading is controlled
+         * with the methods above.
+         */
+        void readAll();
+
+        /**
+         * Returns the index of the sentence read by \a readText or \a readAll or -1
+         * if nothing is read.
+         */
+        int readingPosition() const;
+
         /**
          * Returns true if automatic text-to-speech is enabled or false if disabled.
          */
@@ -150,11 +656,99 @@ class Adaptor : public QObject
         int voiceType() const;
         void setVoiceType(int type);
 
+        /**
+         * Returns the voices of the speech synthesizer. The list is cached so calling
+         * this does not talk to speech-dispatcher.
+         */
+        KAccessibleVoiceList voices() const;
+
+        /**
+         * Returns the languages of the voices of the speech synthesizer.
+         */
+        QStringList languages() const;
+
+        /**
+         * Returns the name of the voice used or an empty string if the voice type is used.
+         */
+        QString voice() const;
+
+        /**
+         * Sets the voice with the \p name as listed by \a voices . An empty name selects
+         * the voice by the voice type again.
+         */
+        void setVoice(const QString &name);
+
         //void cancelSpeech();
         //void speechPaused();
         //void pauseSpeech();
         //void resumeSpeech();
         
+    private Q_SLOTS:
+        void serviceUnregistered(const QString &service);
+        void restoredServiceChecked(QDBusPendingCallWatcher *watcher);
+        void sourceProcessResolved(QDBusPendingCallWatcher *watcher);
+        void processInbound();
+        void idleTimeout();
+        void warmUp();
+        void textNormalized();
+        void speechProgressed();
+        void announceBridgeFeatures();
+        void forwardedCallFinished(QDBusPendingCallWatcher *watcher);
+        void readAllStarted(QDBusPendingCallWatcher *watcher);
+        void fetchReading(int count);
+        void readingFetched(QDBusPendingCallWatcher *watcher);
+    protected:
+        virtual void timerEvent(QTimerEvent *event);
+    private:
+        QString source() const;
+        Source* sourceFor(const QString &service);
+        void enqueue(int reason, const KAccessibleInterface& iface);
+        void processFocusChanged(const KAccessibleInterface& iface, const QString& service);
+        void processValueChanged(const KAccessibleInterface& iface, const QString& service);
+        void processAlert(const KAccessibleInterface& iface, const QString& service);
+        void processNameChanged(const KAccessibleInterface& iface, const QString& service);
+        void mergeFocus(const KAccessibleInterface& iface, const QString& service, const ProfileDecision& decision);
+        void flushUtterance();
+        void say(int reason, const KAccessibleInterface& iface, Source *source);
+        void sayUnlessRepeated(const QString& text, int priority);
+        void updateVerbosity();
+        void enableBridgeFeature(int feature);
+        void updateSpeechFeatures();
+        void playCue(int reason, int state);
+        void loadFilters();
+        void forward(const QString& service, const QDBusMessage& call);
+        void dispatch(int reason, const KAccessibleInterface& iface, Source *source);
+        void emitFocusChanged(const QPoint &point, const QRect &rect);
+        void flushFocusChanged(bool predict);
+        void touch();
+        void watch(const QString &service);
+        void saveState();
+        void restoreState();
+        class Private;
+        Private *const d;
+};
+
+/**
+ * The thread the \a Adaptor and the \a Speaker live in. The thread has its own
+ * connection to the session bus so events are received, processed and emitted
+ * without waiting for the event loop of the user interface.
+ */
+class AdaptorThread : public QThread
+{
+        Q_OBJECT
+    public:
+        explicit AdaptorThread(QObject *parent = 0);
+        virtual ~AdaptorThread();
+
+        /**
+         * Starts the thread and waits till the \a Adaptor got published on the bus.
+         * Returns false if that failed.
+         */
+        bool startAndWait();
+
+        Adaptor* adaptor() const;
+    protected:
+        virtual void run();
     private:
         class Private;
         Private *const d;
@@ -176,6 +770,7 @@ class MainWindow : public KMainWindow
         void enableLogs(int state);
         void enableReaderChanged(int state);
         void voiceTypeChanged(int index);
+        void settingsChanged(const QStringList& keys);
     private:
         class Private;
         Private *const d;
@@ -195,6 +790,9 @@ class KAccessibleApp : public KUniqueApplication
         Adaptor* adaptor() const;
         KAction* action(const QString &name) const;
     private Q_SLOTS:
+        void createUserInterface();
+        void showMainWindow();
+        void systemTrayActivated(QSystemTrayIcon::ActivationReason reason);
         void enableScreenreader(bool enabled);
         void speakClipboard();
         void speakText();
@@ -21,18 +21,256 @@
 #include "kaccessibleinterface.h"
 
 #include <QAccessibleInterface>
+#include <QApplication>
 #include <QWidget>
+#include <QKeyEvent>
+#include <QLineEdit>
+#include <QTextEdit>
+#include <QPlainTextEdit>
+#include <QTextDocument>
+#include <QDateTime>
 #include <QFile>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QSet>
+#include <QPointer>
+#include <QRegExp>
+#include <QTimer>
 #include <QDBusConnection>
-#include <QDBusConnectionInterface>
-#include <QDBusInterface>
+#include <QDBusMessage>
 #include <QDBusPendingCall>
+#include <QDBusPendingCallWatcher>
+#include <QDBusPendingReply>
+#include <QDBusError>
 #include <QDBusArgument>
 #include <QDBusMetaType>
 #include <kdebug.h>
 
+#include <stdio.h>
+#if defined(Q_OS_LINUX)
+#include <unistd.h>
+#endif
+
 Q_EXPORT_PLUGIN(BridgePlugin)
 
+/// The average time one notifyAccessibilityUpdate call may take, in microseconds.
+static const qint64 s_eventBudgetUsec = 20;
+
+/// The number of children of a moved or hidden window whose position is sent along.
+static const int s_maxGeometryChildren = 256;
+
+/// The time one slice of the tree publishing may take, in microseconds.
+static const qint64 s_treeSliceUsec = 2000;
+
+/// The number of children per object that are published, e.g. the rows of a large view.
+static const int s_maxTreeChildren = 256;
+
+/// A page of a query holds at most that many objects and takes at most that many microseconds.
+static const int s_queryPageSize = 128;
+static const qint64 s_queryPageUsec = 5000;
+
+/// The number of queries with more pages that are kept and for how long, in milliseconds.
+static const int s_maxQueries = 8;
+static const qint64 s_queryTimeoutMsecs = 10000;
+
+/// A page of a reading takes at most that many microseconds.
+static const qint64 s_readSliceUsec = 5000;
+
+/// An object whose children are read, the top of the stack in Bridge::readMore .
+class BridgeReadFrame
+{
+    public:
+        QPointer<QObject> m_object;
+        bool m_visited; // the object itself was read
+        int m_next; // the next child to read, 1-based
+        explicit BridgeReadFrame(QObject *object = 0) : m_object(object), m_visited(false), m_next(1) {}
+};
+
+/// The number of items of a popup menu that are sent once it opens.
+static const int s_maxPopupItems = 64;
+
+/// The number of filter rules that are followed, more are ignored.
+static const int s_maxFilterRules = 64;
+
+/**
+ * The filter rules of kaccessibleapp compiled for the events of this application.
+ * The rules are indexed by reason and the class names they match are cached per
+ * QMetaObject as bit mask, so most events are decided without any string compare.
+ * The objectName and the state are only looked at for the rules left after that.
+ */
+class BridgeFilter
+{
+    public:
+        explicit BridgeFilter() : m_anyReasonMask(0) {}
+
+        void setRules(const KAccessibleFilterList &filters)
+        {
+            m_rules.clear();
+            m_reasonMasks.clear();
+            m_anyReasonMask = 0;
+            m_classMasks.clear();
+            m_hits.clear();
+            for(int i = 0; i < filters.count() && i < s_maxFilterRules; ++i) {
+                const KAccessibleFilter &filter = filters.at(i);
+                Rule rule;
+                rule.m_className = QRegExp(filter.className, Qt::CaseSensitive, QRegExp::Wildcard);
+                rule.m_objectName = QRegExp(filter.objectName, Qt::CaseSensitive, QRegExp::Wildcard);
+                rule.m_state = filter.state;
+                m_rules.append(rule);
+                m_hits.append(0);
+                const quint64 bit = quint64(1) << i;
+                if(filter.reasons.isEmpty())
+                    m_anyReasonMask |= bit;
+                foreach(int reason, filter.reasons)
+                    m_reasonMasks[reason] |= bit;
+            }
+        }
+
+        bool isEmpty() const { return m_rules.isEmpty(); }
+
+        /**
+         * Returns true if a rule drops the event with the \p reason for the \p child of
+         * the \p object and counts the hit.
+         */
+        bool matches(int reason, QAccessibleInterface *interface, QObject *object, int child)
+        {
+            quint64 candidates = m_anyReasonMask | m_reasonMasks.value(reason);
+            if(!candidates)
+                return false;
+            const QMetaObject *metaObject = object->metaObject();
+            QHash<const QMetaObject*, quint64>::ConstIterator it = m_classMasks.constFind(metaObject);
+            if(it == m_classMasks.constEnd()) {
+                const QString className = QLatin1String( metaObject->className() );
+                quint64 mask = 0;
+                for(int i = 0; i < m_rules.count(); ++i)
+                    if(m_rules.at(i).m_className.isEmpty() || m_rules.at(i).m_className.exactMatch(className))
+                        mask |= quint64(1) << i;
+                it = m_classMasks.insert(metaObject, mask);
+            }
+            candidates &= it.value();
+
+            bool haveState = false;
+            int state = 0;
+            for(int i = 0; candidates; ++i, candidates >>= 1) {
+                if(!(candidates & 1))
+                    continue;
+                const Rule &rule = m_rules.at(i);
+                if(!rule.m_objectName.isEmpty() && !rule.m_objectName.exactMatch(object->objectName()))
+                    continue;
+                if(rule.m_state) {
+                    if(!haveState) {
+                        state = interface->state(child);
+                        haveState = true;
+                    }
+                    if(!(state & rule.m_state))
+                        continue;
+                }
+                ++m_hits[i];
+                return true;
+            }
+            return false;
+        }
+
+        QList<qulonglong> m_hits;
+
+    private:
+        class Rule
+        {
+            public:
+                QRegExp m_className;
+                QRegExp m_objectName;
+                int m_state;
+        };
+        QList<Rule> m_rules;
+        QHash<int, quint64> m_reasonMasks;
+        quint64 m_anyReasonMask;
+        QHash<const QMetaObject*, quint64> m_classMasks;
+};
+
+/// The handles of a query that did not fit into the pages returned so far.
+class BridgeQuery
+{
+    public:
+        KAccessibleHandleList m_handles;
+        int m_fields;
+        QElapsedTimer m_age;
+        explicit BridgeQuery() : m_fields(0) {}
+};
+
+/**
+ * Collects the time spent in \a Bridge::notifyAccessibilityUpdate . The statistics
+ * are only collected if the KACCESSIBLEBRIDGE_STATS environment variable is set and
+ * are written to stderr after each 1000 events together with the resident memory
+ * of the process. The memory includes everything the application allocated, the
+ * share of the bridge is measured by benchmark.sh. See the "Performance" section in
+ * the README.
+ */
+class BridgeStatistics
+{
+    public:
+        explicit BridgeStatistics()
+            : m_enabled(!qgetenv("KACCESSIBLEBRIDGE_STATS").isEmpty())
+            , m_events(0)
+            , m_totalNsecs(0)
+            , m_maxNsecs(0)
+        {
+        }
+
+        bool isEnabled() const { return m_enabled; }
+
+        void addSample(qint64 nsecs)
+        {
+            m_totalNsecs += nsecs;
+            m_maxNsecs = qMax(m_maxNsecs, nsecs);
+            if(++m_events < 1000)
+                return;
+
+            const qint64 averageUsec = m_totalNsecs / m_events / 1000;
+            fprintf(stderr, "kaccessiblebridge: %d events in %lld us (average %lld us, max %lld us, budget %lld us), resident memory %lld kB%s\n",
+                    m_events, m_totalNsecs / 1000, averageUsec, m_maxNsecs / 1000, s_eventBudgetUsec, residentMemoryKb(),
+                    averageUsec > s_eventBudgetUsec ? " OVER BUDGET" : "");
+            m_events = 0;
+            m_totalNsecs = m_maxNsecs = 0;
+        }
+
+        static qint64 residentMemoryKb()
+        {
+#if defined(Q_OS_LINUX)
+            QFile f(QLatin1String( "/proc/self/statm" ));
+            if(f.open(QIODevice::ReadOnly)) {
+                const QList<QByteArray> fields = f.readAll().split(' ');
+                if(fields.count() > 1)
+                    return fields[1].toLongLong() * (sysconf(_SC_PAGESIZE) / 1024);
+            }
+#endif
+            return 0;
+        }
+
+    private:
+        const bool m_enabled;
+        int m_events;
+        qint64 m_totalNsecs;
+        qint64 m_maxNsecs;
+};
+
+/// Measures the lifetime of the scope if the statistics are enabled.
+class BridgeStatisticsScope
+{
+    public:
+        explicit BridgeStatisticsScope(BridgeStatistics *statistics)
+            : m_statistics(statistics->isEnabled() ? statistics : 0)
+        {
+            if(m_statistics) m_timer.start();
+        }
+        ~BridgeStatisticsScope()
+        {
+            if(m_statistics) m_statistics->addSample(m_timer.nsecsElapsed());
+        }
+    private:
+        BridgeStatistics *m_statistics;
+        QElapsedTimer m_timer;
+};
+
 class Bridge::Private
 {
     public:
@@ -42,45 +280,84 @@ class Bridge::Private
         QList<QObject*> m_popupMenus;
         QRect m_lastFocusRect;
         QString m_lastFocusName;
+        QObject *m_lastFocusObject;
+        int m_lastFocusChild;
+        int m_lastFocusState;
+        BridgeStatistics m_statistics;
+        QHash<QObject*, quint32> m_handles;
+        QHash<quint32, QObject*> m_objects;
+        quint32 m_lastHandle;
+        QHash<const QMetaObject*, QString> m_classNames;
+        QHash<int, BridgeQuery> m_queries;
+        int m_lastQuery;
+        int m_features;
+        KAccessibleObjectList m_pendingGeometry;
+        bool m_geometryScheduled;
+        QList< QPointer<QObject> > m_treeQueue;
+        QSet<QObject*> m_treeVisited;
+        KAccessibleNodeList m_treeNodes;
+        KAccessibleHandleList m_treeRemoved;
+        bool m_treeReset;
+        bool m_treeScheduled;
+        QList<BridgeReadFrame> m_readStack;
+        int m_readSession;
+        QObject *m_echoObject;
+        QString m_echoWord;
+        QPointer<QObject> m_echoPending; // the text field a key was typed into
+        QString m_echoText;
+        qint64 m_echoTimestamp;
+        QString m_echoOldText; // of a QLineEdit
+        int m_echoRevision; // of the document of a QTextEdit or QPlainTextEdit
+        int m_echoCharacters;
+        BridgeFilter m_filter;
 
         Private(BridgePlugin *plugin, const QString& key)
             : m_plugin(plugin)
             , m_key(key)
             , m_root(0)
             , m_lastFocusRect(QRect(0,0,0,0))
-            , m_app(0)
+            , m_lastFocusObject(0)
+            , m_lastFocusChild(0)
+            , m_lastFocusState(0)
+            , m_lastHandle(0)
+            , m_lastQuery(0)
+            , m_features(0)
+            , m_geometryScheduled(false)
+            , m_treeReset(false)
+            , m_treeScheduled(false)
+            , m_readSession(0)
+            , m_echoObject(0)
+            , m_echoTimestamp(0)
+            , m_echoRevision(0)
+            , m_echoCharacters(0)
         {
         }
 
-        ~Private()
+        /**
+         * Sends the \p iface to the org.kde.kaccessibleapp dbus-service by calling the
+         * \p method . The call is done without waiting for or evaluating a reply. If
+         * the dbus-service is not running yet it is started by the dbus-daemon.
+         */
+        void send(const QString &method, const KAccessibleInterface &iface)
         {
-            delete m_app;
+            send(method, qVariantFromValue(iface));
         }
 
-        QDBusInterface* app()
+        void send(const QString &method, const QVariant &argument)
         {
-           Q_ASSERT(m_root);
-           if(!m_app) {
-                m_app = new QDBusInterface(QLatin1String("org.kde.kaccessibleapp"), QLatin1String("/Adaptor"));
-                if(m_app->isValid()) {
-                   kDebug() << "Connected with the org.kde.kaccessibleapp dbus-service";
-                   KAccessibleInterface dbusIface;
-                   dbusIface.set(m_root, 0);
-                   m_app->asyncCall(QLatin1String("setRootObject"), qVariantFromValue(dbusIface));
-                }
-            }
-            if(m_app->lastError().isValid()) {
-                kDebug() << "DBus error:" << m_app->lastError().name() << m_app->lastError().message();
-                delete m_app; m_app = 0;
-            } else if(!m_app->isValid()) {
-                kDebug() << "Failed to connect with the org.kde.kaccessibleapp dbus-service";
-                delete m_app; m_app = 0;
+            send(method, QVariantList() << argument);
+        }
+
+        void send(const QString &method, const QVariantList &arguments)
+        {
+            QDBusMessage message = QDBusMessage::createMethodCall(QLatin1String( "org.kde.kaccessibleapp" ), QLatin1String( "/Adaptor" ), QLatin1String( "org.kde.kaccessibleapp.Adaptor" ), method);
+            message.setArguments(arguments);
+            if( ! QDBusConnection::sessionBus().send(message)) {
+                kDebug() << "DBus error:" << QDBusConnection::sessionBus().lastError().name() << QDBusConnection::sessionBus().lastError().message();
             }
-            return m_app;
-       }
-    private:
-        QDBusInterface *m_app;
+        }
 };
+
 Bridge::Bridge(BridgePlugin *plugin, const QString& key)
     : QObject(plugin)
     , QAccessibleBridge()
@@ -93,69 +370,152 @@ Bridge::~Bridge()
     delete d;
 }
 
-void Bridge::notifyAccessibilityUpdate(int reason, QAccessibleInterface *interface, int child)
+qulonglong Bridge::handle(QObject *object, int child)
 {
-    if(reason == QAccessible::ObjectShow || reason == QAccessible::ObjectHide) {
-        return;
+    QHash<QObject*, quint32>::ConstIterator it = d->m_handles.constFind(object);
+    quint32 id;
+    if(it != d->m_handles.constEnd()) {
+        id = it.value();
+    } else {
+        id = ++d->m_lastHandle;
+        d->m_handles.insert(object, id);
+        d->m_objects.insert(id, object);
+        connect(object, SIGNAL(destroyed(QObject*)), this, SLOT(objectDestroyed(QObject*)));
+    }
+    return (qulonglong(id) << 32) | quint32(child);
+}
+
+void Bridge::objectDestroyed(QObject *object)
+{
+    const quint32 id = d->m_handles.take(object);
+    d->m_objects.remove(id);
+    if(id && (d->m_features & KAccessibleGeometryEvents)) {
+        // The child index 0 removes the object together with its child elements.
+        KAccessibleObject o;
+        o.handle = qulonglong(id) << 32;
+        queueGeometry(o);
     }
+    if(id && (d->m_features & KAccessibleTreeSync)) {
+        // Removes the node together with its children in the mirror.
+        d->m_treeRemoved.append(qulonglong(id) << 32);
+        scheduleTree();
+    }
+    d->m_treeVisited.remove(object);
+    if(d->m_echoObject == object)
+        d->m_echoObject = 0;
+    if(d->m_lastFocusObject == object)
+        d->m_lastFocusObject = 0;
+}
+
+void Bridge::notifyAccessibilityUpdate(int reason, QAccessibleInterface *interface, int child)
+{
+    BridgeStatisticsScope statisticsScope(&d->m_statistics);
 
     if(!d->m_root) {
         return;
     }
 
     QObject *obj = interface->object();
-    if(!obj) {
-         return;
-    }
 
-    QDBusInterface* app = d->app();
-    if(!app) {
+    // The filter rules are applied before anything is fetched from the interface.
+    if(obj && !d->m_filter.isEmpty() && d->m_filter.matches(reason, interface, obj, child)) {
         return;
     }
 
-    const QString name = interface->text(QAccessible::Name, child);
-    const QString description = interface->text(QAccessible::Description, child);
-
-    KAccessibleInterface dbusIface;
-    dbusIface.set(interface, child);
+    if(reason == QAccessible::ObjectShow || reason == QAccessible::ObjectHide || reason == QAccessible::LocationChanged) {
+        if(d->m_features & KAccessibleGeometryEvents)
+            geometryChanged(reason, interface, child);
+        return;
+    }
 
-    QAccessibleInterface *childInterface = 0;
-    //if(child > 0) interface->navigate(QAccessible::Child, child, &childInterface);
+    if(!obj) {
+         return;
+    }
 
+    // Only the reasons that are send to the kaccessibleapp are worth extracting the
+    // QAccessibleInterface information for. All other reasons are only logged and
+    // the kDebug arguments are only evaluated if debug output is enabled.
     switch(reason) {
         case QAccessible::PopupMenuStart: {
             d->m_popupMenus.append(obj);
+            if(d->m_features & KAccessibleEarcons)
+                d->send(QLatin1String( "setEventCue" ), QVariantList() << reason << 0);
+            // The items are likely focused next, kaccessibleapp prepares their speech.
+            if(d->m_features & KAccessiblePopupItems) {
+                KAccessibleInterfaceList items;
+                const int count = qMin(interface->childCount(), s_maxPopupItems);
+                for(int i = 1; i <= count; ++i) {
+                    KAccessibleInterface item;
+                    item.set(interface, i, KAccessibleInterface::Name | KAccessibleInterface::Description | KAccessibleInterface::Value | KAccessibleInterface::Accelerator | KAccessibleInterface::Role);
+                    item.handle = handle(obj, i);
+                    items.append(item);
+                }
+                if(!items.isEmpty())
+                    d->send(QLatin1String( "setPopupItems" ), qVariantFromValue(items));
+            }
         } break;
         case QAccessible::PopupMenuEnd: {
             const int index = d->m_popupMenus.lastIndexOf(obj);
             if(index >= 0) d->m_popupMenus.removeAt(index);
+            if(d->m_features & KAccessibleEarcons)
+                d->send(QLatin1String( "setEventCue" ), QVariantList() << reason << 0);
         } break;
 
         case QAccessible::Alert: {
             //kDebug() << reasonToString(reason) << "object=" << (obj ? QString("%1 (%2)").arg(obj->objectName()).arg(obj->metaObject()->className()) : "NULL") << "name=" << name;
-            app->asyncCall(QLatin1String( "setAlert" ), qVariantFromValue(dbusIface));
+            KAccessibleInterface dbusIface;
+            dbusIface.set(interface, child);
+            dbusIface.handle = handle(obj, child);
+            d->send(QLatin1String( "setAlert" ), dbusIface);
         } break;
 
         case QAccessible::DialogStart: {
-            kDebug() << reasonToString(reason) << QLatin1String( "object=" ) << (obj ? QString(QLatin1String( "%1 (%2)" )).arg(obj->objectName()).arg(QLatin1String( obj->metaObject()->className() )) : QLatin1String( "NULL" )) << QLatin1String( "name=" ) << name;
+            kDebug() << reasonToString(reason) << QLatin1String( "object=" ) << (obj ? QString(QLatin1String( "%1 (%2)" )).arg(obj->objectName()).arg(QLatin1String( obj->metaObject()->className() )) : QLatin1String( "NULL" )) << QLatin1String( "name=" ) << interface->text(QAccessible::Name, child);
+            if(d->m_features & KAccessibleEarcons)
+                d->send(QLatin1String( "setEventCue" ), QVariantList() << reason << 0);
             //app->asyncCall("sayText", name);
         } break;
         case QAccessible::DialogEnd: {
-            kDebug() << reasonToString(reason) << QLatin1String( "object=" ) << (obj ? QString(QLatin1String( "%1 (%2)" )).arg(obj->objectName()).arg(QLatin1String( obj->metaObject()->className() )) : QLatin1String( "NULL" )) << QLatin1String( "name=" ) << name;
+            kDebug() << reasonToString(reason) << QLatin1String( "object=" ) << (obj ? QString(QLatin1String( "%1 (%2)" )).arg(obj->objectName()).arg(QLatin1String( obj->metaObject()->className() )) : QLatin1String( "NULL" )) << QLatin1String( "name=" ) << interface->text(QAccessible::Name, child);
             //app->asyncCall("sayText", name);
         } break;
 
         case QAccessible::NameChanged: {
-            kDebug() << reasonToString(reason) << QLatin1String( "object=" ) << (obj ? QString(QLatin1String( "%1 (%2)" )).arg(obj->objectName()).arg(QLatin1String( obj->metaObject()->className() )) : QLatin1String( "NULL" )) << QLatin1String( "name=" ) << name;
-            //app->asyncCall("sayText", name);
+            kDebug() << reasonToString(reason) << QLatin1String( "object=" ) << (obj ? QString(QLatin1String( "%1 (%2)" )).arg(obj->objectName()).arg(QLatin1String( obj->metaObject()->className() )) : QLatin1String( "NULL" )) << QLatin1String( "name=" ) << interface->text(QAccessible::Name, child);
+            // Only the name of the focused object is of interest, kaccessibleapp merges
+            // it into what is said about the focus.
+            if(obj == d->m_lastFocusObject && child == d->m_lastFocusChild) {
+                KAccessibleInterface dbusIface;
+                dbusIface.set(interface, child);
+                dbusIface.handle = handle(obj, child);
+                d->m_lastFocusName = dbusIface.name;
+                d->send(QLatin1String( "setNameChanged" ), dbusIface);
+            }
         } break;
         case QAccessible::ValueChanged: {
-            QString value = interface->text(QAccessible::Value, child);
-            kDebug() << reasonToString(reason) << QLatin1String( "object=" ) << (obj ? QString(QLatin1String( "%1 (%2)" )).arg(obj->objectName() ).arg(QLatin1String( obj->metaObject()->className() )) : QLatin1String( "NULL" )) << QLatin1String( "name=" ) << name << QLatin1String( "value=" ) << value;
-            app->asyncCall(QLatin1String( "setValueChanged" ), qVariantFromValue(dbusIface));
+            KAccessibleInterface dbusIface;
+            dbusIface.set(interface, child);
+            kDebug() << reasonToString(reason) << QLatin1String( "object=" ) << (obj ? QString(QLatin1String( "%1 (%2)" )).arg(obj->objectName() ).arg(QLatin1String( obj->metaObject()->className() )) : QLatin1String( "NULL" )) << QLatin1String( "name=" ) << dbusIface.name << QLatin1String( "value=" ) << dbusIface.value;
+            dbusIface.handle = handle(obj, child);
+            d->send(QLatin1String( "setValueChanged" ), dbusIface);
         } break;
+        case QAccessible::ObjectCreated:
+        case QAccessible::ObjectReorder:
+        case QAccessible::ParentChanged: {
+            if(d->m_features & KAccessibleTreeSync)
+                queueTree(obj);
+        } break;
+
         case QAccessible::StateChanged: {
-            kDebug() << reasonToString(reason) << QLatin1String( "object=" ) << (obj ? QString(QLatin1String( "%1 (%2)" ) ).arg(obj->objectName()).arg(QLatin1String( obj->metaObject()->className() )) : QLatin1String( "NULL" )) << QLatin1String( "name=" )<< name << QLatin1String( "state=" ) << stateToString(dbusIface.state);
+            kDebug() << reasonToString(reason) << QLatin1String( "object=" ) << (obj ? QString(QLatin1String( "%1 (%2)" ) ).arg(obj->objectName()).arg(QLatin1String( obj->metaObject()->className() )) : QLatin1String( "NULL" )) << QLatin1String( "name=" )<< interface->text(QAccessible::Name, child) << QLatin1String( "state=" ) << stateToString(interface->state(child));
+            // A check box of the focus that is toggled is heard as earcon, other state
+            // changes are not worth the dbus call.
+            if((d->m_features & KAccessibleEarcons) && obj == d->m_lastFocusObject && child == d->m_lastFocusChild) {
+                const int state = interface->state(child);
+                if((state ^ d->m_lastFocusState) & QAccessible::Checked)
+                    d->send(QLatin1String( "setEventCue" ), QVariantList() << reason << state);
+                d->m_lastFocusState = state;
+            }
         } break;
 
         case QAccessible::Focus: {
@@ -169,11 +529,16 @@ void Bridge::notifyAccessibilityUpdate(int reason, QAccessibleInterface *interfa
                     return;
             }
 
-            // don't emit the focus changed signal if the focus didn't really changed since last time
-            if(dbusIface.rect == d->m_lastFocusRect && dbusIface.name == d->m_lastFocusName)
+            // don't emit the focus changed signal if the focus didn't really changed since last time. This
+            // is checked before all the other texts are fetched from the QAccessibleInterface.
+            const QRect rect = interface->rect(child);
+            const QString name = interface->text(QAccessible::Name, child);
+            if(rect == d->m_lastFocusRect && name == d->m_lastFocusName)
                 return;
-            d->m_lastFocusRect = dbusIface.rect;
-            d->m_lastFocusName = dbusIface.name;
+            d->m_lastFocusRect = rect;
+            d->m_lastFocusName = name;
+            d->m_lastFocusObject = obj;
+            d->m_lastFocusChild = child;
 
             // here we could add hacks to special case applications/widgets :)
             //
@@ -181,16 +546,112 @@ void Bridge::notifyAccessibilityUpdate(int reason, QAccessibleInterface *interfa
             // if(!w) w = dynamic_cast<QWidget*>(obj);
             // if(w) r = QRect(w->mapToGlobal(QPoint(w->x(), w->y())), w->size());
 
+            // The rect and name fetched above are not fetched again.
+            KAccessibleInterface dbusIface;
+            dbusIface.set(interface, child, KAccessibleInterface::AllFields & ~(KAccessibleInterface::Rect | KAccessibleInterface::Name));
+            dbusIface.rect = rect;
+            dbusIface.name = name;
             kDebug() << reasonToString(reason) << QLatin1String( "object=" ) << (obj ? QString(QLatin1String( "%1 (%2)" )).arg(obj->objectName()).arg(QLatin1String( obj->metaObject()->className() )) : QLatin1String( "NULL" )) << QLatin1String( "name=" ) << name << QLatin1String( "rect=" ) << dbusIface.rect;
-            app->asyncCall(QLatin1String( "setFocusChanged" ), qVariantFromValue(dbusIface));
+            dbusIface.handle = handle(obj, child);
+            d->m_lastFocusState = dbusIface.state;
+            d->send(QLatin1String( "setFocusChanged" ), dbusIface);
         } break;
         default:
-            kDebug() << reasonToString(reason) << QLatin1String( "object=" ) << (obj ? QString(QLatin1String( "%1 (%2)" )).arg(obj->objectName()).arg(QLatin1String( obj->metaObject()->className() )) : QLatin1String( "NULL" )) << QLatin1String( "name=" ) << name;
+            kDebug() << reasonToString(reason) << QLatin1String( "object=" ) << (obj ? QString(QLatin1String( "%1 (%2)" )).arg(obj->objectName()).arg(QLatin1String( obj->metaObject()->className() )) : QLatin1String( "NULL" )) << QLatin1String( "name=" ) << interface->text(QAccessible::Name, child);
+            break;
+    }
+}
+
+bool Bridge::eventFilter(QObject *object, QEvent *event)
+{
+    if(event->type() != QEvent::KeyPress || !object->isWidgetType() || !static_cast<QWidget*>(object)->hasFocus())
+        return false;
+    // Only editable text fields echo, never the content of password fields.
+    QLineEdit *lineEdit = qobject_cast<QLineEdit*>(object);
+    QTextEdit *textEdit = qobject_cast<QTextEdit*>(object);
+    QPlainTextEdit *plainTextEdit = qobject_cast<QPlainTextEdit*>(object);
+    if(!lineEdit && !textEdit && !plainTextEdit)
+        return false;
+    if(object->property("readOnly").toBool() || (lineEdit && lineEdit->echoMode() != QLineEdit::Normal))
+        return false;
+
+    // The key before this one was processed by the widget meanwhile.
+    keyProcessed();
+
+    if(object != d->m_echoObject) {
+        d->m_echoObject = object;
+        d->m_echoWord.clear();
+    }
+    QKeyEvent *keyEvent = static_cast<QKeyEvent*>(event);
+    switch(keyEvent->key()) {
+        case Qt::Key_Backspace:
+            d->m_echoWord.chop(1);
+            return false;
+        case Qt::Key_Delete:
+        case Qt::Key_Left:
+        case Qt::Key_Right:
+        case Qt::Key_Up:
+        case Qt::Key_Down:
+        case Qt::Key_Home:
+        case Qt::Key_End:
+        case Qt::Key_PageUp:
+        case Qt::Key_PageDown:
+            // The cursor left the word that was typed.
+            d->m_echoWord.clear();
+            return false;
+        default:
             break;
     }
+    const QString text = keyEvent->text();
+    if(text.isEmpty() || (keyEvent->modifiers() & (Qt::ControlModifier | Qt::AltModifier | Qt::MetaModifier)))
+        return false;
+    const QChar c = text.at(0);
+    if(!c.isPrint() && !c.isSpace())
+        return false;
+
+    // Only what the widget accepts is echoed, a validator or the maxLength may reject
+    // the key. That is known once the widget processed the key, see keyProcessed.
+    d->m_echoPending = object;
+    d->m_echoText = text;
+    d->m_echoTimestamp = QDateTime::currentMSecsSinceEpoch();
+    if(lineEdit) {
+        d->m_echoOldText = lineEdit->text();
+    } else {
+        QTextDocument *document = textEdit ? textEdit->document() : plainTextEdit->document();
+        d->m_echoRevision = document->revision();
+        d->m_echoCharacters = document->characterCount();
+    }
+    QMetaObject::invokeMethod(this, "keyProcessed", Qt::QueuedConnection);
+    return false;
+}
+
+void Bridge::keyProcessed()
+{
+    QObject *object = d->m_echoPending;
+    if(!object)
+        return;
+    d->m_echoPending = 0;
+    bool accepted;
+    if(QLineEdit *lineEdit = qobject_cast<QLineEdit*>(object)) {
+        accepted = lineEdit->text() != d->m_echoOldText;
+    } else {
+        QTextEdit *textEdit = qobject_cast<QTextEdit*>(object);
+        QTextDocument *document = textEdit ? textEdit->document() : static_cast<QPlainTextEdit*>(object)->document();
+        accepted = document->revision() != d->m_echoRevision || document->characterCount() != d->m_echoCharacters;
+    }
+    d->m_echoOldText.clear();
+    if(!accepted)
+        return;
 
-    delete childInterface;
-    //delete d->m_app; d->m_app = 0;
+    // The word is echoed with the character that ends it.
+    QString word;
+    if(d->m_echoText.at(0).isLetterOrNumber()) {
+        d->m_echoWord += d->m_echoText;
+    } else {
+        word = d->m_echoWord;
+        d->m_echoWord.clear();
+    }
+    d->send(QLatin1String( "setKeyEcho" ), QVariantList() << d->m_echoText << word << d->m_echoTimestamp);
 }
 
 void Bridge::focusChanged(int px, int py, int rx, int ry, int rwidth, int rheight)
@@ -210,17 +671,401 @@ void Bridge::setRootObject(QAccessibleInterface *interface)
         return;
     }
 
-    if( ! QDBusConnection::sessionBus().interface()->isServiceRegistered(QLatin1String( "org.kde.kaccessibleapp" ))) {
-        kDebug()<<"KAccessibleBridge: Starting kaccessibleapp dbus service";
-        QDBusConnection::sessionBus().interface()->startService(QLatin1String( "org.kde.kaccessibleapp" ));
-        if( ! QDBusConnection::sessionBus().interface()->isServiceRegistered(QLatin1String( "org.kde.kaccessibleapp" ))) {
-            kWarning()<<"KAccessibleBridge: Failed to start kaccessibleapp dbus service";
-            d->m_root = 0;
+    // The kaccessibleapp dbus service is not started here but by the dbus-daemon once the
+    // first message got send to it. That way the application's startup is not blocked
+    // while waiting for kaccessibleapp to be activated.
+    KAccessibleInterface dbusIface;
+    dbusIface.set(d->m_root, 0);
+    d->send(QLatin1String( "setRootObject" ), dbusIface);
+
+    // Clients query objects of this application through kaccessibleapp.
+    if( ! QDBusConnection::sessionBus().registerObject(QLatin1String( "/KAccessibleBridge" ), this, QDBusConnection::ExportScriptableSlots)) {
+        kDebug() << "KAccessibleBridge: Failed to register /KAccessibleBridge";
+    }
+
+    // Follow the features kaccessibleapp asks for. The signal is matched for any sender
+    // and the features are fetched asynchronously, both don't wait for kaccessibleapp.
+    QDBusConnection::sessionBus().connect(QString(), QLatin1String( "/Adaptor" ), QLatin1String( "org.kde.kaccessibleapp.Adaptor" ), QLatin1String( "bridgeFeaturesChanged" ), this, SLOT(setFeatures(int)));
+    QDBusMessage message = QDBusMessage::createMethodCall(QLatin1String( "org.kde.kaccessibleapp" ), QLatin1String( "/Adaptor" ), QLatin1String( "org.kde.kaccessibleapp.Adaptor" ), QLatin1String( "bridgeFeatures" ));
+    QDBusPendingCallWatcher *watcher = new QDBusPendingCallWatcher(QDBusConnection::sessionBus().asyncCall(message), this);
+    connect(watcher, SIGNAL(finished(QDBusPendingCallWatcher*)), this, SLOT(featuresFetched(QDBusPendingCallWatcher*)));
+
+    // The filter rules are distributed the same way.
+    QDBusConnection::sessionBus().connect(QString(), QLatin1String( "/Adaptor" ), QLatin1String( "org.kde.kaccessibleapp.Adaptor" ), QLatin1String( "bridgeFiltersChanged" ), this, SLOT(setFilters(KAccessibleFilterList)));
+    message = QDBusMessage::createMethodCall(QLatin1String( "org.kde.kaccessibleapp" ), QLatin1String( "/Adaptor" ), QLatin1String( "org.kde.kaccessibleapp.Adaptor" ), QLatin1String( "bridgeFilters" ));
+    watcher = new QDBusPendingCallWatcher(QDBusConnection::sessionBus().asyncCall(message), this);
+    connect(watcher, SIGNAL(finished(QDBusPendingCallWatcher*)), this, SLOT(filtersFetched(QDBusPendingCallWatcher*)));
+
+    //for testing;
+    //QDBusConnection::sessionBus().connect("org.kde.kaccessibleapp", "/Adaptor", "org.kde.kaccessibleapp.Adaptor", "focusChanged", this, SLOT(focusChanged(int,int,int,int,int,int)));
+}
+
+KAccessibleInterfaceList Bridge::query(const KAccessibleHandleList &handles, int fields, int &cursor)
+{
+    BridgeQuery query;
+    query.m_handles = handles;
+    query.m_fields = fields;
+    return queryPage(query, cursor);
+}
+
+KAccessibleInterfaceList Bridge::queryMore(int cursor, int &nextCursor)
+{
+    QHash<int, BridgeQuery>::Iterator it = d->m_queries.find(cursor);
+    if(it == d->m_queries.end() || it.value().m_age.elapsed() > s_queryTimeoutMsecs) {
+        if(it != d->m_queries.end())
+            d->m_queries.erase(it);
+        nextCursor = 0;
+        return KAccessibleInterfaceList();
+    }
+    const BridgeQuery query = it.value();
+    d->m_queries.erase(it);
+    return queryPage(query, nextCursor);
+}
+
+KAccessibleInterfaceList Bridge::queryPage(const BridgeQuery &query, int &cursor)
+{
+    KAccessibleInterfaceList result;
+    QElapsedTimer timer;
+    timer.start();
+    int i = 0;
+    for(; i < query.m_handles.count(); ++i) {
+        if(result.count() >= s_queryPageSize || (i > 0 && timer.nsecsElapsed() > s_queryPageUsec * 1000))
+            break;
+        const qulonglong handle = query.m_handles.at(i);
+        KAccessibleInterface iface;
+        QObject *obj = d->m_objects.value(quint32(handle >> 32));
+        if(QAccessibleInterface *interface = obj ? QAccessible::queryAccessibleInterface(obj) : 0) {
+            const int child = int(quint32(handle));
+            if(child >= 0 && child <= interface->childCount()) {
+                iface.set(interface, child, query.m_fields & ~KAccessibleInterface::ClassName);
+                if(query.m_fields & KAccessibleInterface::ClassName) {
+                    // The class names are shared between the results.
+                    QString &className = d->m_classNames[obj->metaObject()];
+                    if(className.isEmpty())
+                        className = QLatin1String( obj->metaObject()->className() );
+                    iface.className = className;
+                }
+                iface.handle = handle;
+            }
+            delete interface;
+        }
+        result.append(iface);
+    }
+
+    cursor = 0;
+    if(i < query.m_handles.count()) {
+        // Forget the oldest query if there are too many.
+        if(d->m_queries.count() >= s_maxQueries) {
+            QHash<int, BridgeQuery>::Iterator oldest = d->m_queries.begin();
+            for(QHash<int, BridgeQuery>::Iterator it = d->m_queries.begin(); it != d->m_queries.end(); ++it)
+                if(it.key() < oldest.key())
+                    oldest = it;
+            d->m_queries.erase(oldest);
+        }
+        BridgeQuery rest;
+        rest.m_handles = query.m_handles.mid(i);
+        rest.m_fields = query.m_fields;
+        rest.m_age.start();
+        cursor = ++d->m_lastQuery;
+        d->m_queries.insert(cursor, rest);
+    }
+    return result;
+}
+
+int Bridge::readAll()
+{
+    QObject *window = QApplication::activeWindow();
+    if(!window && d->m_root)
+        window = d->m_root->object();
+    d->m_readStack.clear();
+    if(!window)
+        return 0;
+    d->m_readStack.append(BridgeReadFrame(window));
+    return ++d->m_readSession;
+}
+
+KAccessibleInterfaceList Bridge::readMore(int session, int count, bool &finished)
+{
+    KAccessibleInterfaceList result;
+    if(session != d->m_readSession) {
+        finished = true;
+        return result;
+    }
+
+    // The objects are walked depth-first, one child per step, so the rows of a huge
+    // view are only visited once they are read.
+    QElapsedTimer timer;
+    timer.start();
+    while(!d->m_readStack.isEmpty() && result.count() < count && timer.nsecsElapsed() < s_readSliceUsec * 1000) {
+        BridgeReadFrame &frame = d->m_readStack.last();
+        QObject *obj = frame.m_object;
+        QAccessibleInterface *interface = obj ? QAccessible::queryAccessibleInterface(obj) : 0;
+        if(!interface) {
+            d->m_readStack.removeLast();
+            continue;
+        }
+        int child = 0;
+        if(frame.m_visited) {
+            if(frame.m_next > interface->childCount()) {
+                d->m_readStack.removeLast();
+                delete interface;
+                continue;
+            }
+            child = frame.m_next++;
+        } else {
+            frame.m_visited = true;
+            // Hidden objects are skipped together with their children.
+            if(interface->state(0) & QAccessible::Invisible) {
+                d->m_readStack.removeLast();
+                delete interface;
+                continue;
+            }
+        }
+
+        // The frame is not used anymore from here on since a push may move it.
+        QAccessibleInterface *childInterface = 0;
+        const int entry = child ? interface->navigate(QAccessible::Child, child, &childInterface) : 0;
+        if(childInterface) {
+            if(childInterface->object())
+                d->m_readStack.append(BridgeReadFrame(childInterface->object()));
+            delete childInterface;
+        } else if(child == 0 || entry > 0) {
+            const int element = child ? entry : 0;
+            if(!(interface->state(element) & QAccessible::Invisible)) {
+                KAccessibleInterface iface;
+                iface.set(interface, element, KAccessibleInterface::Name | KAccessibleInterface::Value | KAccessibleInterface::Role);
+                if(!iface.name.isEmpty() || !iface.value.isEmpty()) {
+                    iface.handle = handle(obj, element);
+                    result.append(iface);
+                }
+            }
+        }
+        delete interface;
+    }
+
+    finished = d->m_readStack.isEmpty();
+    return result;
+}
+
+void Bridge::setFeatures(int features)
+{
+    if(d->m_features == features)
+        return;
+    kDebug() << "KAccessibleBridge: features=" << features;
+    const int enabled = features & ~d->m_features;
+    const int disabled = d->m_features & ~features;
+    d->m_features = features;
+    if(enabled & KAccessibleKeyEcho) {
+        qApp->installEventFilter(this);
+    } else if(disabled & KAccessibleKeyEcho) {
+        qApp->removeEventFilter(this);
+        d->m_echoObject = 0;
+        d->m_echoWord.clear();
+        d->m_echoPending = 0;
+    }
+    if(!(d->m_features & KAccessibleGeometryEvents))
+        d->m_pendingGeometry.clear();
+    if(!(d->m_features & KAccessibleTreeSync)) {
+        d->m_treeQueue.clear();
+        d->m_treeVisited.clear();
+        d->m_treeNodes.clear();
+        d->m_treeRemoved.clear();
+    } else if((enabled & KAccessibleTreeSync) && d->m_root && d->m_root->object()) {
+        // Start with a snapshot that replaces what kaccessibleapp may still know.
+        d->m_treeQueue.clear();
+        d->m_treeVisited.clear();
+        d->m_treeReset = true;
+        queueTree(d->m_root->object());
+    }
+}
+
+void Bridge::featuresFetched(QDBusPendingCallWatcher *watcher)
+{
+    QDBusPendingReply<int> reply = *watcher;
+    if(!reply.isError())
+        setFeatures(reply.value());
+    watcher->deleteLater();
+}
+
+void Bridge::setFilters(const KAccessibleFilterList &filters)
+{
+    kDebug() << "KAccessibleBridge: filters=" << filters.count();
+    d->m_filter.setRules(filters);
+}
+
+void Bridge::filtersFetched(QDBusPendingCallWatcher *watcher)
+{
+    QDBusPendingReply<KAccessibleFilterList> reply = *watcher;
+    if(!reply.isError())
+        setFilters(reply.value());
+    watcher->deleteLater();
+}
+
+QList<qulonglong> Bridge::filterHits() const
+{
+    return d->m_filter.m_hits;
+}
+
+void Bridge::geometryChanged(int reason, QAccessibleInterface *interface, int child)
+{
+    const bool remove = reason == QAccessible::ObjectHide;
+    addGeometry(interface, child, remove);
+
+    // The children of a window move and hide together with it without own events.
+    QObject *obj = interface->object();
+    if(child == 0 && reason != QAccessible::ObjectShow && obj && obj->isWidgetType() && static_cast<QWidget*>(obj)->isWindow()) {
+        int budget = s_maxGeometryChildren;
+        addChildGeometry(interface, remove, budget);
+    }
+}
+
+void Bridge::addGeometry(QAccessibleInterface *interface, int child, bool remove)
+{
+    QObject *obj = interface->object();
+    if(!obj)
+        return;
+    KAccessibleObject o;
+    if(remove) {
+        // Objects without handle were never sent, so there is nothing to remove.
+        QHash<QObject*, quint32>::ConstIterator it = d->m_handles.constFind(obj);
+        if(it == d->m_handles.constEnd())
             return;
+        o.handle = (qulonglong(it.value()) << 32) | quint32(child);
+    } else {
+        o.handle = handle(obj, child);
+        o.rect = interface->rect(child);
+        o.name = interface->text(QAccessible::Name, child);
+        o.role = interface->role(child);
+    }
+    queueGeometry(o);
+}
+
+void Bridge::addChildGeometry(QAccessibleInterface *interface, bool remove, int &budget)
+{
+    const int count = interface->childCount();
+    for(int i = 1; i <= count && budget > 0; ++i) {
+        QAccessibleInterface *childInterface = 0;
+        const int entry = interface->navigate(QAccessible::Child, i, &childInterface);
+        if(childInterface) {
+            --budget;
+            addGeometry(childInterface, 0, remove);
+            addChildGeometry(childInterface, remove, budget);
+            delete childInterface;
+        } else if(entry > 0) {
+            --budget;
+            addGeometry(interface, entry, remove);
         }
+    }
+}
 
-        //for testing;
-        //QDBusConnection::sessionBus().connect("org.kde.kaccessibleapp", "/Adaptor", "org.kde.kaccessibleapp.Adaptor", "focusChanged", this, SLOT(focusChanged(int,int,int,int,int,int)));
+void Bridge::queueGeometry(const KAccessibleObject &object)
+{
+    // All the changes done within one event loop iteration are send with one message.
+    d->m_pendingGeometry.append(object);
+    if(!d->m_geometryScheduled) {
+        d->m_geometryScheduled = true;
+        QMetaObject::invokeMethod(this, "flushGeometry", Qt::QueuedConnection);
+    }
+}
+
+void Bridge::flushGeometry()
+{
+    d->m_geometryScheduled = false;
+    if(d->m_pendingGeometry.isEmpty())
+        return;
+    d->send(QLatin1String( "setGeometryChanged" ), qVariantFromValue(d->m_pendingGeometry));
+    d->m_pendingGeometry.clear();
+}
+
+void Bridge::queueTree(QObject *object)
+{
+    // A changed object is published again even if it was already published in this pass.
+    d->m_treeVisited.remove(object);
+    d->m_treeQueue.append(QPointer<QObject>(object));
+    scheduleTree();
+}
+
+void Bridge::scheduleTree()
+{
+    if(!d->m_treeScheduled) {
+        d->m_treeScheduled = true;
+        QTimer::singleShot(0, this, SLOT(processTree()));
+    }
+}
+
+void Bridge::processTree()
+{
+    d->m_treeScheduled = false;
+    if(!(d->m_features & KAccessibleTreeSync))
+        return;
+
+    // The tree is walked in slices so the application is never blocked for long. Objects
+    // destroyed meanwhile are skipped.
+    QElapsedTimer timer;
+    timer.start();
+    while(!d->m_treeQueue.isEmpty() && timer.nsecsElapsed() < s_treeSliceUsec * 1000) {
+        QPointer<QObject> object = d->m_treeQueue.takeFirst();
+        if(!object || d->m_treeVisited.contains(object))
+            continue;
+        d->m_treeVisited.insert(object);
+        if(QAccessibleInterface *interface = QAccessible::queryAccessibleInterface(object)) {
+            addTreeNode(interface);
+            delete interface;
+        }
+    }
+
+    if(!d->m_treeNodes.isEmpty() || !d->m_treeRemoved.isEmpty() || d->m_treeReset) {
+        d->send(QLatin1String( "setTreeChanged" ), QVariantList() << d->m_treeReset << qVariantFromValue(d->m_treeNodes) << qVariantFromValue(d->m_treeRemoved));
+        d->m_treeReset = false;
+        d->m_treeNodes.clear();
+        d->m_treeRemoved.clear();
+    }
+
+    if(!d->m_treeQueue.isEmpty())
+        scheduleTree();
+    else
+        d->m_treeVisited.clear();
+}
+
+void Bridge::addTreeNode(QAccessibleInterface *interface)
+{
+    QObject *obj = interface->object();
+    KAccessibleNode node;
+    node.handle = handle(obj, 0);
+    QAccessibleInterface *parent = 0;
+    interface->navigate(QAccessible::Ancestor, 1, &parent);
+    if(parent) {
+        if(parent->object())
+            node.parent = handle(parent->object(), 0);
+        node.index = parent->indexOfChild(interface);
+        delete parent;
+    }
+    node.role = interface->role(0);
+    node.name = interface->text(QAccessible::Name, 0);
+    node.className = QLatin1String( obj->metaObject()->className() );
+    node.childCount = interface->childCount();
+    d->m_treeNodes.append(node);
+
+    // Child objects are walked later, child elements like the rows of a view are
+    // published right away.
+    const int count = qMin(node.childCount, s_maxTreeChildren);
+    for(int i = 1; i <= count; ++i) {
+        QAccessibleInterface *childInterface = 0;
+        const int entry = interface->navigate(QAccessible::Child, i, &childInterface);
+        if(childInterface) {
+            if(childInterface->object())
+                d->m_treeQueue.append(QPointer<QObject>(childInterface->object()));
+            delete childInterface;
+        } else if(entry > 0) {
+            KAccessibleNode element;
+            element.handle = handle(obj, entry);
+            element.parent = node.handle;
+            element.index = i;
+            element.role = interface->role(entry);
+            element.name = interface->text(QAccessible::Name, entry);
+            element.className = node.className;
+            d->m_treeNodes.append(element);
+        }
     }
 }
 
@@ -228,6 +1073,14 @@ BridgePlugin::BridgePlugin(QObject *parent)
     : QAccessibleBridgePlugin(parent)
 {
     qDBusRegisterMetaType<KAccessibleInterface>();
+    qDBusRegisterMetaType<KAccessibleInterfaceList>();
+    qDBusRegisterMetaType<KAccessibleObject>();
+    qDBusRegisterMetaType<KAccessibleObjectList>();
+    qDBusRegisterMetaType<KAccessibleNode>();
+    qDBusRegisterMetaType<KAccessibleNodeList>();
+    qDBusRegisterMetaType<KAccessibleHandleList>();
+    qDBusRegisterMetaType<KAccessibleFilter>();
+    qDBusRegisterMetaType<KAccessibleFilterList>();
 }
 
 BridgePlugin::~BridgePlugin()
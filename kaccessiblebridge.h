@@ -24,6 +24,14 @@
 
 class Bridge;
 class BridgePlugin;
+class BridgeQuery;
+class KAccessibleObject;
+class KAccessibleInterface;
+typedef QList<KAccessibleInterface> KAccessibleInterfaceList;
+typedef QList<qulonglong> KAccessibleHandleList;
+class KAccessibleFilter;
+typedef QList<KAccessibleFilter> KAccessibleFilterList;
+class QDBusPendingCallWatcher;
 
 /**
  * This class implements a QAccessibleBridge that will be created
@@ -32,6 +40,7 @@ class BridgePlugin;
 class Bridge : public QObject, public QAccessibleBridge
 {
         Q_OBJECT
+        Q_CLASSINFO("D-Bus Interface", "org.kde.kaccessiblebridge")
     public:
         Bridge(BridgePlugin *plugin, const QString& key);
         virtual ~Bridge();
@@ -53,6 +62,54 @@ class Bridge : public QObject, public QAccessibleBridge
          */
         virtual void setRootObject(QAccessibleInterface *interface);
 
+        /**
+         * Filters the key presses of the application while the KAccessibleKeyEcho feature
+         * is enabled. Keys typed into a focused text field are sent once the field took
+         * them, see \a keyProcessed , without waiting for the accessibility update that
+         * follows.
+         */
+        virtual bool eventFilter(QObject *object, QEvent *event);
+
+    public Q_SLOTS:
+
+        /**
+         * Returns the KAccessibleInterface of the objects with the \p handles with only
+         * the \p fields of the KAccessibleInterface::Field mask filled. The result is in
+         * the order of the handles, unknown objects have a handle of 0. A page is limited
+         * in size and in the time it takes to collect. If there are more results the
+         * \p cursor is set to a value that can be passed to \a queryMore , else it is 0.
+         *
+         * This is published on the session bus as /KAccessibleBridge once the bridge got
+         * its root object.
+         */
+        Q_SCRIPTABLE KAccessibleInterfaceList query(const KAccessibleHandleList &handles, int fields, int &cursor);
+
+        /**
+         * Returns the next page of a \a query . The \p cursor is only valid for a few
+         * seconds.
+         */
+        Q_SCRIPTABLE KAccessibleInterfaceList queryMore(int cursor, int &nextCursor);
+
+        /**
+         * Starts to read the active window in document order and returns the session
+         * to pass to \a readMore . Starting again ends the previous session.
+         */
+        Q_SCRIPTABLE int readAll();
+
+        /**
+         * Returns up to \p count of the next objects with a name or a value of the
+         * \p session . Only the name, value and role are filled. The objects are walked
+         * while they are asked for and one call takes only a few milliseconds, so less
+         * objects may be returned. \p finished is set to true at the end of the window.
+         */
+        Q_SCRIPTABLE KAccessibleInterfaceList readMore(int session, int count, bool &finished);
+
+        /**
+         * Returns how many events each of the filter rules dropped, in the order the
+         * rules were passed to \a setFilters .
+         */
+        Q_SCRIPTABLE QList<qulonglong> filterHits() const;
+
     private Q_SLOTS:
 
         /**
@@ -67,7 +124,37 @@ class Bridge : public QObject, public QAccessibleBridge
          */
         void focusChanged(int px, int py, int rx, int ry, int rwidth, int rheight);
 
+        void objectDestroyed(QObject *object);
+
+        /**
+         * Sets the KAccessibleFeature flags kaccessibleapp asks for.
+         */
+        void setFeatures(int features);
+        void featuresFetched(QDBusPendingCallWatcher *watcher);
+
+        /**
+         * Sets the rules events are dropped with before they are evaluated.
+         */
+        void setFilters(const KAccessibleFilterList &filters);
+        void filtersFetched(QDBusPendingCallWatcher *watcher);
+        void flushGeometry();
+        void processTree();
+
+        /**
+         * Sends the key typed last if the text field accepted it.
+         */
+        void keyProcessed();
+
     private:
+        qulonglong handle(QObject *object, int child);
+        KAccessibleInterfaceList queryPage(const BridgeQuery &query, int &cursor);
+        void geometryChanged(int reason, QAccessibleInterface *interface, int child);
+        void addGeometry(QAccessibleInterface *interface, int child, bool remove);
+        void addChildGeometry(QAccessibleInterface *interface, bool remove, int &budget);
+        void queueGeometry(const KAccessibleObject &object);
+        void queueTree(QObject *object);
+        void scheduleTree();
+        void addTreeNode(QAccessibleInterface *interface);
         class Private;
         Private *const d;
 };
@@ -22,6 +22,11 @@
 #include <QMetaType>
 #include <QMetaObject>
 #include <QList>
+#include <QHash>
+#include <QStringList>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QtAlgorithms>
 #include <QAccessibleInterface>
 #include <QDBusArgument>
 
@@ -44,32 +49,88 @@ class KAccessibleInterface
 
         QAccessible::State state;
 
-        explicit KAccessibleInterface() : state(QFlags<QAccessible::StateFlag>()) {}
+        /**
+         * Identifies the object within the application that sent it. The upper 32 bits
+         * are an id the bridge assigned to the QObject and the lower 32 bits are the
+         * child index. The handle is 0 if unknown.
+         */
+        qulonglong handle;
+
+        /**
+         * The QAccessible::Role of the object, e.g. a slider or a check box.
+         */
+        int role;
+
+        /**
+         * The fields a client can ask for, see the subscribe dbus method
+         * of the \a KAccessibleApp application.
+         */
+        enum Field {
+            Name = 0x01,
+            Description = 0x02,
+            Value = 0x04,
+            Accelerator = 0x08,
+            Rect = 0x10,
+            ObjectName = 0x20,
+            ClassName = 0x40,
+            State = 0x80,
+            Role = 0x100,
+            AllFields = 0x1ff
+        };
+
+        explicit KAccessibleInterface() : state(QFlags<QAccessible::StateFlag>()), handle(0), role(QAccessible::NoRole) {}
 
         void set(QAccessibleInterface *interface, int child)
         {
-            name = interface->text(QAccessible::Name, child);
-            const QString desc = interface->text(QAccessible::Description, child);
-            description = desc.isEmpty() ? interface->text(QAccessible::Help, child) : desc;
-            value = interface->text(QAccessible::Value, child);
-            accelerator = interface->text(QAccessible::Accelerator, child);
-            rect = interface->rect(child);
-            objectName = interface->object()->objectName();
-            QObject *object = interface->object();
-            className = QString::fromLatin1(object->metaObject()->className());
-            state = interface->state(child);
+            set(interface, child, AllFields);
+        }
+
+        /**
+         * Fills only the \p fields of the Field mask, the others are not fetched from
+         * the \p interface .
+         */
+        void set(QAccessibleInterface *interface, int child, int fields)
+        {
+            if(fields & Name) name = interface->text(QAccessible::Name, child);
+            if(fields & Description) {
+                const QString desc = interface->text(QAccessible::Description, child);
+                description = desc.isEmpty() ? interface->text(QAccessible::Help, child) : desc;
+            }
+            if(fields & Value) value = interface->text(QAccessible::Value, child);
+            if(fields & Accelerator) accelerator = interface->text(QAccessible::Accelerator, child);
+            if(fields & Rect) rect = interface->rect(child);
+            if(fields & ObjectName) objectName = interface->object()->objectName();
+            if(fields & ClassName) className = QString::fromLatin1(interface->object()->metaObject()->className());
+            if(fields & State) state = interface->state(child);
+            if(fields & Role) role = interface->role(child);
+        }
+
+        /**
+         * Clears all fields that are not part of the \p fields mask.
+         */
+        void strip(int fields)
+        {
+            if(!(fields & Name)) name.clear();
+            if(!(fields & Description)) description.clear();
+            if(!(fields & Value)) value.clear();
+            if(!(fields & Accelerator)) accelerator.clear();
+            if(!(fields & Rect)) rect = QRect();
+            if(!(fields & ObjectName)) objectName.clear();
+            if(!(fields & ClassName)) className.clear();
+            if(!(fields & State)) state = QAccessible::State();
+            if(!(fields & Role)) role = QAccessible::NoRole;
         }
 };
 
 Q_DECLARE_METATYPE(KAccessibleInterface)
 
-//typedef QList<KAccessibleInterface*> KAccessibleInterfaceList;
-//Q_DECLARE_METATYPE(KAccessibleInterfaceList)
+typedef QList<KAccessibleInterface> KAccessibleInterfaceList;
+Q_DECLARE_METATYPE(KAccessibleInterfaceList)
 
 QDBusArgument &operator<<(QDBusArgument &argument, const KAccessibleInterface &a)
 {
     argument.beginStructure();
-    argument << a.name << a.description << a.value << a.accelerator << a.rect << a.objectName << a.className << int(a.state);
+    argument << a.name << a.description << a.value << a.accelerator << a.rect << a.objectName << a.className << int(a.state) << a.handle << a.role;
     argument.endStructure();
     return argument;
 }
@@ -78,81 +139,484 @@ const QDBusArgument &operator>>(const QDBusArgument &argument, KAccessibleInterf
 {
     argument.beginStructure();
     int state;
-    argument >> a.name >> a.description >> a.value >> a.accelerator >> a.rect >> a.objectName >> a.className >> state;
+    argument >> a.name >> a.description >> a.value >> a.accelerator >> a.rect >> a.objectName >> a.className >> state >> a.handle >> a.role;
     a.state = QAccessible::State(state);
     argument.endStructure();
     return argument;
 }
 
+/**
+ * This class represents a focus change as remembered by the \a KAccessibleApp
+ * application. Clients fetch it with the currentFocus and focusHistory dbus
+ * methods to know the focus without waiting for the next focusChanged signal.
+ */
+class KAccessibleFocus
+{
+    public:
+        QRect rect;
+        QPoint point;
+        KAccessibleInterface iface;
+        QString source;
+        qint64 timestamp;
+
+        explicit KAccessibleFocus() : point(-1, -1), timestamp(0) {}
+};
+
+Q_DECLARE_METATYPE(KAccessibleFocus)
+
+typedef QList<KAccessibleFocus> KAccessibleFocusList;
+Q_DECLARE_METATYPE(KAccessibleFocusList)
+
+QDBusArgument &operator<<(QDBusArgument &argument, const KAccessibleFocus &f)
+{
+    argument.beginStructure();
+    argument << f.rect << f.point << f.iface << f.source << f.timestamp;
+    argument.endStructure();
+    return argument;
+}
+
+const QDBusArgument &operator>>(const QDBusArgument &argument, KAccessibleFocus &f)
+{
+    argument.beginStructure();
+    argument >> f.rect >> f.point >> f.iface >> f.source >> f.timestamp;
+    argument.endStructure();
+    return argument;
+}
+
+/**
+ * This class represents an event delivered by the \a KAccessibleApp
+ * application to a subscribed client.
+ */
+class KAccessibleEvent
+{
+    public:
+        int reason;
+        KAccessibleInterface iface;
+        QString source;
+        qint64 timestamp;
+
+        explicit KAccessibleEvent() : reason(0), timestamp(0) {}
+};
+
+Q_DECLARE_METATYPE(KAccessibleEvent)
+
+typedef QList<KAccessibleEvent> KAccessibleEventList;
+Q_DECLARE_METATYPE(KAccessibleEventList)
+
+QDBusArgument &operator<<(QDBusArgument &argument, const KAccessibleEvent &e)
+{
+    argument.beginStructure();
+    argument << e.reason << e.iface << e.source << e.timestamp;
+    argument.endStructure();
+    return argument;
+}
+
+const QDBusArgument &operator>>(const QDBusArgument &argument, KAccessibleEvent &e)
+{
+    argument.beginStructure();
+    argument >> e.reason >> e.iface >> e.source >> e.timestamp;
+    argument.endStructure();
+    return argument;
+}
+
+/**
+ * This class represents a voice of the speech synthesizer as listed by the
+ * voices dbus method of the \a KAccessibleApp application.
+ */
+class KAccessibleVoice
+{
+    public:
+        QString name;
+        QString language;
+        QString variant;
+};
+
+Q_DECLARE_METATYPE(KAccessibleVoice)
+
+typedef QList<KAccessibleVoice> KAccessibleVoiceList;
+Q_DECLARE_METATYPE(KAccessibleVoiceList)
+
+QDBusArgument &operator<<(QDBusArgument &argument, const KAccessibleVoice &v)
+{
+    argument.beginStructure();
+    argument << v.name << v.language << v.variant;
+    argument.endStructure();
+    return argument;
+}
+
+const QDBusArgument &operator>>(const QDBusArgument &argument, KAccessibleVoice &v)
+{
+    argument.beginStructure();
+    argument >> v.name >> v.language >> v.variant;
+    argument.endStructure();
+    return argument;
+}
+
+/**
+ * This class represents the position of an object as known by the \a KAccessibleApp
+ * application. The bridges send it while the KAccessibleGeometryEvents feature is
+ * enabled and clients get it from the hitTest and objectsInRect dbus methods.
+ */
+class KAccessibleObject
+{
+    public:
+        /// The dbus service of the application the object belongs to.
+        QString source;
+        /// See KAccessibleInterface::handle .
+        qulonglong handle;
+        /// The rect in screen coordinates or an empty rect if the object is gone.
+        QRect rect;
+        QString name;
+        int role;
+
+        explicit KAccessibleObject() : handle(0), role(QAccessible::NoRole) {}
+};
+
+Q_DECLARE_METATYPE(KAccessibleObject)
+
+typedef QList<KAccessibleObject> KAccessibleObjectList;
+Q_DECLARE_METATYPE(KAccessibleObjectList)
+
+QDBusArgument &operator<<(QDBusArgument &argument, const KAccessibleObject &o)
+{
+    argument.beginStructure();
+    argument << o.source << o.handle << o.rect << o.name << o.role;
+    argument.endStructure();
+    return argument;
+}
+
+const QDBusArgument &operator>>(const QDBusArgument &argument, KAccessibleObject &o)
+{
+    argument.beginStructure();
+    argument >> o.source >> o.handle >> o.rect >> o.name >> o.role;
+    argument.endStructure();
+    return argument;
+}
+
+/**
+ * This class represents an object in the accessible tree of an application. The
+ * bridges publish their tree while the KAccessibleTreeSync feature is enabled and
+ * clients query the mirror the \a KAccessibleApp application keeps of it.
+ */
+class KAccessibleNode
+{
+    public:
+        /// See KAccessibleInterface::handle .
+        qulonglong handle;
+        /// The handle of the parent or 0 for the root.
+        qulonglong parent;
+        /// The 1-based position within the children of the parent.
+        int index;
+        /// The number of children the object has. Only some of the child elements of
+        /// large views are published, so there may be less nodes.
+        int childCount;
+        int role;
+        QString name;
+        QString className;
+
+        explicit KAccessibleNode() : handle(0), parent(0), index(0), childCount(0), role(QAccessible::NoRole) {}
+};
+
+Q_DECLARE_METATYPE(KAccessibleNode)
+
+typedef QList<KAccessibleNode> KAccessibleNodeList;
+Q_DECLARE_METATYPE(KAccessibleNodeList)
+
+QDBusArgument &operator<<(QDBusArgument &argument, const KAccessibleNode &n)
+{
+    argument.beginStructure();
+    argument << n.handle << n.parent << n.index << n.childCount << n.role << n.name << n.className;
+    argument.endStructure();
+    return argument;
+}
+
+const QDBusArgument &operator>>(const QDBusArgument &argument, KAccessibleNode &n)
+{
+    argument.beginStructure();
+    argument >> n.handle >> n.parent >> n.index >> n.childCount >> n.role >> n.name >> n.className;
+    argument.endStructure();
+    return argument;
+}
+
+typedef QList<qulonglong> KAccessibleHandleList;
+Q_DECLARE_METATYPE(KAccessibleHandleList)
+
+/**
+ * A rule the bridges drop events with before anything else is fetched from the
+ * QAccessibleInterface. The \a KAccessibleApp application reads the rules from its
+ * config and distributes them with the bridgeFilters dbus method and the
+ * bridgeFiltersChanged dbus signal. An event is dropped if all the conditions of a
+ * rule match, empty conditions match always.
+ */
+class KAccessibleFilter
+{
+    public:
+        /// The name of the rule, only used to tell the rules apart.
+        QString name;
+        /// A glob for the class name, e.g. "KPixmapSequence*".
+        QString className;
+        /// A glob for the objectName.
+        QString objectName;
+        /// The rule matches if any of these QAccessible::State flags is set.
+        int state;
+        /// The QAccessible::Event reasons the rule applies to.
+        QList<int> reasons;
+
+        explicit KAccessibleFilter() : state(0) {}
+};
+
+Q_DECLARE_METATYPE(KAccessibleFilter)
+
+typedef QList<KAccessibleFilter> KAccessibleFilterList;
+Q_DECLARE_METATYPE(KAccessibleFilterList)
+
+QDBusArgument &operator<<(QDBusArgument &argument, const KAccessibleFilter &f)
+{
+    argument.beginStructure();
+    argument << f.name << f.className << f.objectName << f.state << f.reasons;
+    argument.endStructure();
+    return argument;
+}
+
+const QDBusArgument &operator>>(const QDBusArgument &argument, KAccessibleFilter &f)
+{
+    argument.beginStructure();
+    argument >> f.name >> f.className >> f.objectName >> f.state >> f.reasons;
+    argument.endStructure();
+    return argument;
+}
+
+/**
+ * The optional work the bridges do on behalf of the \a KAccessibleApp application.
+ * They are enabled only while a client needs them so applications don't pay for
+ * what nobody uses. The bridges fetch them with the bridgeFeatures dbus method and
+ * follow the bridgeFeaturesChanged dbus signal.
+ */
+enum KAccessibleFeature {
+    /// Send the position of objects that got shown, moved, hidden or destroyed.
+    KAccessibleGeometryEvents = 0x01,
+    /// Publish the accessible tree, first as snapshot and then its changes.
+    KAccessibleTreeSync = 0x02,
+    /// Send the keys typed into focused text fields.
+    KAccessibleKeyEcho = 0x04,
+    /// Send the events that are heard as earcons, see Adaptor::setEventCue .
+    KAccessibleEarcons = 0x08,
+    /// Send the items of popup menus once opened, see Adaptor::setPopupItems .
+    KAccessiblePopupItems = 0x10
+};
+
+/// The QAccessible::Event reasons by name.
+static const struct {
+    int value;
+    const char *name;
+} s_reasonTable[] = {
+    { QAccessible::SoundPlayed, "SoundPlayed" },
+    { QAccessible::Alert, "Alert" },
+    { QAccessible::ForegroundChanged, "ForegroundChanged" },
+    { QAccessible::MenuStart, "MenuStart" },
+    { QAccessible::MenuEnd, "MenuEnd" },
+    { QAccessible::PopupMenuStart, "PopupMenuStart" },
+    { QAccessible::PopupMenuEnd, "PopupMenuEnd" },
+    { QAccessible::ContextHelpStart, "ContextHelpStart" },
+    { QAccessible::ContextHelpEnd, "ContextHelpEnd" },
+    { QAccessible::DragDropStart, "DragDropStart" },
+    { QAccessible::DragDropEnd, "DragDropEnd" },
+    { QAccessible::DialogStart, "DialogStart" },
+    { QAccessible::DialogEnd, "DialogEnd" },
+    { QAccessible::ScrollingStart, "ScrollingStart" },
+    { QAccessible::ScrollingEnd, "ScrollingEnd" },
+    { QAccessible::MenuCommand, "MenuCommand" },
+    { QAccessible::ObjectCreated, "ObjectCreated" },
+    { QAccessible::ObjectDestroyed, "ObjectDestroyed" },
+    { QAccessible::ObjectShow, "ObjectShow" },
+    { QAccessible::ObjectHide, "ObjectHide" },
+    { QAccessible::ObjectReorder, "ObjectReorder" },
+    { QAccessible::Focus, "Focus" },
+    { QAccessible::Selection, "Selection" },
+    { QAccessible::SelectionAdd, "SelectionAdd" },
+    { QAccessible::SelectionRemove, "SelectionRemove" },
+    { QAccessible::SelectionWithin, "SelectionWithin" },
+    { QAccessible::StateChanged, "StateChanged" },
+    { QAccessible::LocationChanged, "LocationChanged" },
+    { QAccessible::NameChanged, "NameChanged" },
+    { QAccessible::DescriptionChanged, "DescriptionChanged" },
+    { QAccessible::ValueChanged, "ValueChanged" },
+    { QAccessible::ParentChanged, "ParentChanged" },
+    { QAccessible::HelpChanged, "HelpChanged" },
+    { QAccessible::DefaultActionChanged, "DefaultActionChanged" },
+    { QAccessible::AcceleratorChanged, "AcceleratorChanged" },
+    { 0, 0 }
+};
+
+/// The QAccessible::State flags by name, in the order they are formatted.
+static const struct {
+    int value;
+    const char *name;
+} s_stateTable[] = {
+    { QAccessible::Animated, "Animated" },
+    { QAccessible::Busy, "Busy" },
+    { QAccessible::Checked, "Checked" },
+    { QAccessible::Collapsed, "Collapsed" },
+    { QAccessible::DefaultButton, "DefaultButton" },
+    { QAccessible::Expanded, "Expanded" },
+    { QAccessible::ExtSelectable, "ExtSelectable" },
+    { QAccessible::Focusable, "Focusable" },
+    { QAccessible::Focused, "Focused" },
+    { QAccessible::HasPopup, "HasPopup" },
+    { QAccessible::HotTracked, "HotTracked" },
+    { QAccessible::Invisible, "Invisible" },
+    { QAccessible::Linked, "Linked" },
+    { QAccessible::Marqueed, "Marqueed" },
+    { QAccessible::Mixed, "Mixed" },
+    { QAccessible::Modal, "Modal" },
+    { QAccessible::Movable, "Movable" },
+    { QAccessible::MultiSelectable, "MultiSelectable" },
+    { QAccessible::Offscreen, "Offscreen" },
+    { QAccessible::Pressed, "Pressed" },
+    { QAccessible::Protected, "Protected" },
+    { QAccessible::ReadOnly, "ReadOnly" },
+    { QAccessible::Selectable, "Selectable" },
+    { QAccessible::Selected, "Selected" },
+    { QAccessible::SelfVoicing, "SelfVoicing" },
+    { QAccessible::Sizeable, "Sizeable" },
+    { QAccessible::Traversed, "Traversed" },
+    { QAccessible::Unavailable, "Unavailable" },
+    { 0, 0 }
+};
+
+/// The number of state combinations whose formatting is cached.
+static const int s_maxCachedStates = 256;
+
+/**
+ * The registry of the names of the QAccessible::Event reasons and QAccessible::State
+ * flags. The names are built once from the tables above and shared by everyone who
+ * formats or parses them, e.g. the debug output of the bridges, the logs and the
+ * filter rules. The registry is read-only once built except for the cache of formatted
+ * state combinations, which is locked, so it can be used from any thread.
+ */
+class KAccessibleMetadata
+{
+    public:
+        explicit KAccessibleMetadata()
+        {
+            for(int i = 0; s_reasonTable[i].name; ++i) {
+                const QString name = QLatin1String( s_reasonTable[i].name );
+                m_reasonNames.insert(s_reasonTable[i].value, name);
+                m_reasons.insert(name, s_reasonTable[i].value);
+            }
+            // The state names are indexed by bit so formatting only visits the set bits.
+            for(int i = 0; i < 32; ++i)
+                m_stateOrder[i] = 0;
+            for(int i = 0; s_stateTable[i].name; ++i) {
+                const QString name = QLatin1String( s_stateTable[i].name );
+                m_states.insert(name, s_stateTable[i].value);
+                m_stateOrder[bitIndex(s_stateTable[i].value)] = i + 1;
+                m_stateNames.append(name);
+            }
+        }
+
+        static KAccessibleMetadata* instance();
+
+        /// Returns the name of the \p reason or the number if unknown.
+        QString reasonName(int reason) const
+        {
+            QHash<int, QString>::ConstIterator it = m_reasonNames.constFind(reason);
+            return it != m_reasonNames.constEnd() ? it.value() : QString::number(reason);
+        }
+
+        /// Returns the reason with the \p name or -1 if unknown. Numbers are accepted too.
+        int reason(const QString &name) const
+        {
+            QHash<QString, int>::ConstIterator it = m_reasons.constFind(name);
+            if(it != m_reasons.constEnd())
+                return it.value();
+            bool ok;
+            const int reason = name.toInt(&ok, 0);
+            return ok ? reason : -1;
+        }
+
+        /// Returns the names of the set \p flags separated by a space.
+        QString stateNames(int flags) const
+        {
+            QMutexLocker locker(&m_cacheMutex);
+            QHash<int, QString>::ConstIterator it = m_stateCache.constFind(flags);
+            if(it != m_stateCache.constEnd())
+                return it.value();
+            // The flags are visited bit by bit and formatted in the order of the table.
+            int order[32];
+            int count = 0;
+            for(quint32 bits = quint32(flags), i = 0; bits; bits >>= 1, ++i)
+                if((bits & 1) && m_stateOrder[i])
+                    order[count++] = m_stateOrder[i] - 1;
+            qSort(order, order + count);
+            QString result;
+            for(int i = 0; i < count; ++i) {
+                if(i)
+                    result += QLatin1Char(' ');
+                result += m_stateNames.at(order[i]);
+            }
+            if(m_stateCache.count() < s_maxCachedStates)
+                m_stateCache.insert(flags, result);
+            return result;
+        }
+
+        /// Returns the state flag with the \p name or 0 if unknown.
+        int state(const QString &name) const
+        {
+            return m_states.value(name);
+        }
+
+    private:
+        static int bitIndex(int flag)
+        {
+            int i = 0;
+            while(i < 31 && !(quint32(flag) & (quint32(1) << i)))
+                ++i;
+            return i;
+        }
+
+        QHash<int, QString> m_reasonNames;
+        QHash<QString, int> m_reasons;
+        QStringList m_stateNames;
+        int m_stateOrder[32]; // bit => index into m_stateNames + 1, 0 if unnamed
+        QHash<QString, int> m_states;
+        mutable QHash<int, QString> m_stateCache;
+        mutable QMutex m_cacheMutex;
+};
+
+Q_GLOBAL_STATIC(KAccessibleMetadata, accessibleMetadata)
+
+KAccessibleMetadata* KAccessibleMetadata::instance()
+{
+    return accessibleMetadata();
+}
+
 QString reasonToString(int reason)
 {
-    switch(reason) {
-        case QAccessible::Focus: return QLatin1String( "Focus" );
-        case QAccessible::MenuCommand: return QLatin1String( "MenuCommand" );
-        case QAccessible::MenuStart: return QLatin1String( "MenuStart" );
-        case QAccessible::MenuEnd: return QLatin1String( "MenuEnd" );
-        case QAccessible::PopupMenuEnd: return QLatin1String( "PopupMenuEnd" );
-        case QAccessible::PopupMenuStart: return QLatin1String( "PopupMenuStart" );
-        case QAccessible::ScrollingEnd: return QLatin1String( "ScrollingEnd" );
-        case QAccessible::ScrollingStart: return QLatin1String( "ScrollingStart" );
-        case QAccessible::Selection: return QLatin1String( "Selection" );
-        case QAccessible::StateChanged: return QLatin1String( "StateChanged" );
-        case QAccessible::ValueChanged: return QLatin1String( "ValueChanged" );
-        case QAccessible::NameChanged: return QLatin1String( "NameChanged" );
-        case QAccessible::ObjectCreated: return QLatin1String( "ObjectCreated" );
-        case QAccessible::ObjectDestroyed: return QLatin1String( "ObjectDestroyed" );
-        case QAccessible::ObjectHide: return QLatin1String( "ObjectHide" );
-        case QAccessible::ObjectReorder: return QLatin1String( "ObjectReorder" );
-        case QAccessible::ObjectShow: return QLatin1String( "ObjectShow" );
-        case QAccessible::ParentChanged: return QLatin1String( "ParentChanged" );
-        case QAccessible::Alert: return QLatin1String( "Alert" );
-        case QAccessible::DefaultActionChanged: return QLatin1String( "DefaultActionChanged" );
-        case QAccessible::DialogEnd: return QLatin1String( "DialogEnd" );
-        case QAccessible::DialogStart: return QLatin1String( "DialogStart" );
-        case QAccessible::DragDropEnd: return QLatin1String( "DragDropEnd" );
-        case QAccessible::DragDropStart: return QLatin1String( "DragDropStart" );
-        case QAccessible::ForegroundChanged: return QLatin1String( "ForegroundChanged" );
-        case QAccessible::LocationChanged: return QLatin1String( "LocationChanged" );
-        case QAccessible::SelectionAdd: return QLatin1String( "SelectionAdd" );
-        case QAccessible::SelectionRemove: return QLatin1String( "SelectionRemove" );
-        case QAccessible::SelectionWithin: return QLatin1String( "SelectionWithin" );
-    }
-    return QString::number(reason);
+    return KAccessibleMetadata::instance()->reasonName(reason);
 }
 
 QString stateToString(QAccessible::State flags)
 {
-    QString result;
-    if(flags & QAccessible::Animated) result += QLatin1String( "Animated " );
-    if(flags & QAccessible::Busy) result += QLatin1String( "Busy " );
-    if(flags & QAccessible::Checked) result += QLatin1String( "Checked " );
-    if(flags & QAccessible::Collapsed) result += QLatin1String( "Collapsed " );
-    if(flags & QAccessible::DefaultButton) result += QLatin1String( "DefaultButton " );
-    if(flags & QAccessible::Expanded) result += QLatin1String( "Expanded " );
-    if(flags & QAccessible::ExtSelectable) result += QLatin1String( "ExtSelectable " );
-    if(flags & QAccessible::Focusable) result += QLatin1String( "Focusable " );
-    if(flags & QAccessible::Focused) result += QLatin1String( "Focused " );
-    if(flags & QAccessible::HasPopup) result += QLatin1String( "HasPopup " );
-    if(flags & QAccessible::HotTracked) result += QLatin1String( "HotTracked " );
-    if(flags & QAccessible::Invisible) result += QLatin1String( "Invisible " );
-    if(flags & QAccessible::Linked) result += QLatin1String( "Linked " );
-    if(flags & QAccessible::Marqueed) result += QLatin1String( "Marqueed " );
-    if(flags & QAccessible::Mixed) result += QLatin1String( "Mixed " );
-    if(flags & QAccessible::Modal) result += QLatin1String( "Modal " );
-    if(flags & QAccessible::Movable) result += QLatin1String( "Movable " );
-    if(flags & QAccessible::MultiSelectable) result += QLatin1String( "MultiSelectable " );
-    if(flags & QAccessible::Normal) result += QLatin1String( "Normal " );
-    if(flags & QAccessible::Offscreen) result += QLatin1String( "Offscreen " );
-    if(flags & QAccessible::Pressed) result += QLatin1String( "Pressed " );
-    if(flags & QAccessible::Protected) result += QLatin1String( "Protected " );
-    if(flags & QAccessible::ReadOnly) result += QLatin1String( "ReadOnly " );
-    if(flags & QAccessible::Selectable) result += QLatin1String( "Selectable " );
-    if(flags & QAccessible::Selected) result += QLatin1String( "Selected " );
-    if(flags & QAccessible::SelfVoicing) result += QLatin1String( "SelfVoicing " );
-    if(flags & QAccessible::Sizeable) result += QLatin1String( "Sizeable " );
-    if(flags & QAccessible::Traversed) result += QLatin1String( "Traversed " );
-    if(flags & QAccessible::Unavailable) result += QLatin1String( "Unavailable " );
-    return result.trimmed();
+    return KAccessibleMetadata::instance()->stateNames(flags);
+}
+
+/**
+ * Returns the QAccessible::Event of the \p name as returned by \a reasonToString or
+ * -1 if there is none. Numbers are accepted too.
+ */
+int reasonFromString(const QString &name)
+{
+    return KAccessibleMetadata::instance()->reason(name);
+}
+
+/**
+ * Returns the QAccessible::State flag of the \p name as returned by \a stateToString
+ * or 0 if there is none.
+ */
+int stateFromString(const QString &name)
+{
+    return KAccessibleMetadata::instance()->state(name);
 }
 
 #endif